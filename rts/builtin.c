@@ -56,29 +56,121 @@ int64_t bytesLength(Box* string) {
     return str->length;
 }
 
+/*
+  Counts code points as the bytes that aren't UTF-8 continuation bytes, once per string:
+  the count is cached in the header tag. Literals get it at compile time.
+*/
+int64_t stringCodePointCount(String* str) {
+    if (str->header.tag > 0) return str->header.tag - 1;
+    int64_t count = 0;
+    for (int64_t i = 0; i < str->length; i++) {
+        count += (str->bytes[i] & 0xc0) != 0x80;
+    }
+    if (count < INT32_MAX) str->header.tag = (int32_t) (count + 1);
+    return count;
+}
+
+int64_t codePointCount(Box* string) {
+    return stringCodePointCount(unbox(LASTRING, string));
+}
+
+int8_t stringIsAscii(Box* string) {
+    String* str = unbox(LASTRING, string);
+    return stringCodePointCount(str) == str->length;
+}
+
+/*
+  Code point index to byte offset of the last codePointAt on a non-ASCII string,
+  so that loops over indices walk the string once instead of from the start on every call.
+  withArena resets it, the string may be freed with the arena.
+  It's a GC root, so the last indexed string stays alive until another one is indexed.
+*/
+static struct {
+    String* string;
+    int64_t index;
+    int64_t offset;
+} STRING_CURSOR;
+
+void resetStringCursor(void) {
+    STRING_CURSOR.string = NULL;
+}
+
+int32_t codePointAt(Box* string, int64_t index) {
+    String* str = unbox(LASTRING, string);
+    int64_t count = stringCodePointCount(str);
+    if (index < 0 || index >= count) {
+        printf("Index is out of range: %"PRId64"\n", index);
+        exit(1);
+    }
+    if (count == str->length) return (uint8_t) str->bytes[index]; // ASCII
+    int64_t i = 0, offset = 0;
+    if (STRING_CURSOR.string == str && STRING_CURSOR.index - index < index) {
+        i = STRING_CURSOR.index;
+        offset = STRING_CURSOR.offset;
+    }
+    for (; i < index; i++) {
+        do offset++; while ((str->bytes[offset] & 0xc0) == 0x80);
+    }
+    for (; i > index; i--) {
+        do offset--; while ((str->bytes[offset] & 0xc0) == 0x80);
+    }
+    STRING_CURSOR.string = str;
+    STRING_CURSOR.index = index;
+    STRING_CURSOR.offset = offset;
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_iterate((const utf8proc_uint8_t *) str->bytes + offset, str->length - offset, &codepoint);
+    if (codepoint == -1) {
+        printf("Invalid UTF-8 near position %"PRId64"\n", offset);
+        exit(1);
+    }
+    return codepoint;
+}
+
+/*
+  Calls f for every code point of a string until f returns false.
+  Iterates up to the byte length, like the loops of lowered String.iterate calls, see loopsPhase in Desugar.hs
+*/
 Box* codePointsIterate(Box* string, Box* f) {
     String * str = unbox(LASTRING, string);
     bool cont = true;
     utf8proc_int32_t codepoint = -1;
     utf8proc_ssize_t offset = 0;
-    size_t length = 0;
     Position pos = {0, 0};
-    while (cont) {
-        offset += utf8proc_iterate((const utf8proc_uint8_t *) str->bytes + offset, -1, &codepoint);
+    while (cont && offset < str->length) {
+        offset += utf8proc_iterate((const utf8proc_uint8_t *) str->bytes + offset, str->length - offset, &codepoint);
         if (codepoint == -1) {
             printf("Invalid UTF-8 near position %zd\n", offset);
             exit(1);
-        } if (codepoint == 0) {
-            return &UNIT_SINGLETON;
-        } else {
-            Box* cp = (Box*) boxInt32(codepoint);
-            Box* res = runtimeApply(f, 1, &cp, pos);
-            cont = asBool(unbox(LABOOL, res))->num;
         }
+        Box* cp = boxInt32(codepoint);
+        Box* res = runtimeApply(f, 1, &cp, pos);
+        cont = boolValue(unbox(LABOOL, res));
     }
     return &UNIT_SINGLETON;
 }
 
+/*
+  Code point at a byte offset of a string and the length of its UTF-8 encoding.
+  Used by String.iterate calls lowered to native loops, see loopsPhase in Desugar.hs
+*/
+int32_t codePointAtOffset(Box* string, int64_t offset) {
+    String * str = unbox(LASTRING, string);
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_iterate((const utf8proc_uint8_t *) str->bytes + offset, str->length - offset, &codepoint);
+    if (codepoint == -1) {
+        printf("Invalid UTF-8 near position %"PRId64"\n", offset);
+        exit(1);
+    }
+    return codepoint;
+}
+
+int64_t codePointByteLength(int32_t codePoint) {
+    if (codePoint < 0x80) return 1;
+    else if (codePoint < 0x800) return 2;
+    else if (codePoint < 0x10000) return 3;
+    else return 4;
+}
+
 Box* graphemesIterate(Box* string, Box* f) {
     String * str = unbox(LASTRING, string);
     bool cont = true;
@@ -110,7 +202,7 @@ Box* graphemesIterate(Box* string, Box* f) {
                 cluster[length + 1] = 0;
                 Box* s = (Box*) makeString((char *) cluster);
                 Box* res = runtimeApply(f, 1, &s, pos);
-                cont = asBool(unbox(LABOOL, res))->num;
+                cont = boolValue(unbox(LABOOL, res));
                 length = 0;
             }
         }
@@ -129,12 +221,11 @@ String* codePointToString(int32_t codePoint) {
 Box* codePointsToString(Box* array) {
     Array* arr = unbox(LAARRAY, array);
     utf8proc_ssize_t len = 4 * arr->length; // potentially each codepoint is encoded as 4 bytes utf8.
-    String* string = gcMalloc(sizeof(String) + len + 1);
+    String* string = gcMallocString(LASTRING, len);
     utf8proc_ssize_t offset = 0;
     for (size_t i = 0; i < arr->length; i++) {
-        offset += utf8proc_encode_char(asInt32(arr->data[i])->num, (utf8proc_uint8_t *) &string->bytes[offset]);
+        offset += utf8proc_encode_char(int32Value(arr->data[i]), (utf8proc_uint8_t *) &string->bytes[offset]);
     }
-    string->type = LASTRING;
     string->bytes[offset] = 0;
     string->length = offset;
     return box(LASTRING, string);
@@ -147,46 +238,51 @@ Box* print(const Box* val) {
 }
 
 Box* println(const Box* val) {
-//    printf("println: %p %p\n", LASTRING, val->type);
+//    printf("println: %p %p\n", LASTRING, laTypeOf(val));
     String * str = unbox(LASTRING, val);
     printf("%s\n", str->bytes);
     return &UNIT_SINGLETON;
 }
 
 int64_t runtimeCompare(Box* lhs, Box* rhs) {
-    if (!eqTypes(lhs->type, rhs->type)) {
-        printf("AAAA!!! runtimeCompare: Type mismatch! lhs = %s, rhs = %s\n", typeIdToName(lhs->type), typeIdToName(rhs->type));
+    // Immediate Ints and immediate Bool/Byte/Int16/Int32 of the same kind compare by value
+    if (isImmediateInt(lhs) && isImmediateInt(rhs)) {
+        int64_t l = intValue(lhs), r = intValue(rhs);
+        return l < r ? -1 : l == r ? 0 : 1;
+    }
+    const LaType* type = laTypeOf(lhs);
+    if (!eqTypes(type, laTypeOf(rhs))) {
+        printf("AAAA!!! runtimeCompare: Type mismatch! lhs = %s, rhs = %s\n", typeIdToName(type), typeIdToName(laTypeOf(rhs)));
         exit(1);
     }
     int64_t result = 0;
-    if (eqTypes(lhs->type, LABOOL)) {
-        result =
-                asBool(lhs)->num < asBool(rhs)->num ? -1 :
-                asBool(lhs)->num == asBool(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LABYTE)) {
-        result =
-                asByte(lhs)->num < asByte(rhs)->num ? -1 :
-                asByte(lhs)->num == asByte(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LAINT)) {
-        result =
-                asInt(lhs)->num < asInt(rhs)->num ? -1 :
-                asInt(lhs)->num == asInt(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LAINT16)) {
-        result =
-                asInt16(lhs)->num < asInt16(rhs)->num ? -1 :
-                asInt16(lhs)->num == asInt16(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LAINT32)) {
-        result =
-                asInt32(lhs)->num < asInt32(rhs)->num ? -1 :
-                asInt32(lhs)->num == asInt32(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LAFLOAT64)) {
+    switch (type->id) {
+      case LATYPE_ID_BOOL:
+      case LATYPE_ID_BYTE:
+      case LATYPE_ID_INT16:
+      case LATYPE_ID_INT32: {
+        int32_t l = immediateValue(lhs), r = immediateValue(rhs);
+        result = l < r ? -1 : l == r ? 0 : 1;
+        break;
+      }
+      case LATYPE_ID_INT: {
+        int64_t l = intValue(lhs), r = intValue(rhs);
+        result = l < r ? -1 : l == r ? 0 : 1;
+        break;
+      }
+      case LATYPE_ID_FLOAT64:
         result =
                 asFloat(lhs)->num < asFloat(rhs)->num ? -1 :
                 asFloat(lhs)->num == asFloat(rhs)->num ? 0 : 1;
-    } else if (eqTypes(lhs->type, LASTRING)) {
+        break;
+      case LATYPE_ID_STRING:
         result = strcmp(asString(lhs)->bytes, asString(rhs)->bytes); // TODO do proper unicode stuff
-    } else {
-        printf("AAAA!!! runtimeCompare is not defined for type %s\n", typeIdToName(lhs->type));
+        break;
+      case LATYPE_ID_SYMBOL:
+        result = lhs == rhs ? 0 : asSymbol(lhs)->id < asSymbol(rhs)->id ? -1 : 1;
+        break;
+      default:
+        printf("AAAA!!! runtimeCompare is not defined for type %s\n", typeIdToName(type));
         exit(1);
     }
     result = result < 0 ? (int64_t) -1 : result == 0 ? 0 : 1;
@@ -194,11 +290,19 @@ int64_t runtimeCompare(Box* lhs, Box* rhs) {
 }
 
 Box* arrayAppend(Box* fst, Box* snd) {
-    Array* f = unbox(LAARRAY, fst);
-    Array* s = unbox(LAARRAY, snd);
-    Array* array = createArray(f->length + s->length);
-    memcpy(array->data, f->data, f->length * sizeof(void*));
-    memcpy(array->data + f->length, s->data, s->length * sizeof(void*));
+    const LaType* type = laTypeOf(fst);
+    int64_t flen = arrayLength(fst);
+    int64_t slen = arrayLength(snd);
+    if (eqTypes(type, laTypeOf(snd)) && !eqTypes(type, LAARRAY)) {
+        // same raw kind: elements are 8 bytes, like Box*
+        void* array = eqTypes(type, LAINTARRAY) ? (void*) createIntArray(flen + slen) : (void*) createFloatArray(flen + slen);
+        memcpy(asIntArray(array)->data, asIntArray(fst)->data, flen * sizeof(int64_t));
+        memcpy(asIntArray(array)->data + flen, asIntArray(snd)->data, slen * sizeof(int64_t));
+        return array;
+    }
+    Array* array = createArray(flen + slen);
+    arrayCopy(fst, 0, (Box*) array, 0, flen);
+    arrayCopy(snd, 0, (Box*) array, flen, slen);
     return box(LAARRAY, array);
 }
 
@@ -210,28 +314,94 @@ Box* makeArray(int64_t size, Box* init) {
     return box(LAARRAY, array);
 }
 
+Box* makeIntArray(int64_t size, int64_t init) {
+    IntArray* array = createIntArray(size);
+    for (int64_t i = 0; i < size; i++) {
+        array->data[i] = init;
+    }
+    return (Box*) array;
+}
+
+Box* makeFloatArray(int64_t size, double init) {
+    FloatArray* array = createFloatArray(size);
+    for (int64_t i = 0; i < size; i++) {
+        array->data[i] = init;
+    }
+    return (Box*) array;
+}
+
+Box* unsafeCreateIntArray(int64_t size) {
+    return (Box*) createIntArray(size);
+}
+
+Box* unsafeCreateFloatArray(int64_t size) {
+    return (Box*) createFloatArray(size);
+}
+
 Box* arrayCopy(Box* src, int64_t srcPos, Box* dest, int64_t destPos, int64_t length) {
-    Array* s = unbox(LAARRAY, src);
-    Array* d = unbox(LAARRAY, dest);
+    int64_t srcLength = arrayLength(src);
+    int64_t destLength = arrayLength(dest);
     assert(srcPos >= 0);
     assert(destPos >= 0);
     assert(length >= 0);
-    assert(srcPos+length <= s->length);
-    assert(destPos+length <= d->length);
-    memcpy(&d->data[destPos], &s->data[srcPos], length * sizeof(void*));
+    assert(srcPos+length <= srcLength);
+    assert(destPos+length <= destLength);
+    if (eqTypes(laTypeOf(src), laTypeOf(dest))) {
+        // Box*, int64_t and double elements are all 8 bytes
+        memmove(&asArray(dest)->data[destPos], &asArray(src)->data[srcPos], length * sizeof(void*));
+        if (LASCA_WRITE_BARRIER && eqTypes(laTypeOf(dest), LAARRAY)) {
+            for (int64_t i = 0; i < length; i++) gcWriteBarrier(dest, &asArray(dest)->data[destPos + i]);
+        }
+    } else {
+        for (int64_t i = 0; i < length; i++) {
+            arraySetIndex(dest, destPos + i, arrayGetIndex(src, srcPos + i));
+        }
+    }
     return &UNIT_SINGLETON;
 }
 
+// Raw Int and Float arrays return boxed elements here. Compiled code reads them directly, see cgenArrayApply
 Box* arrayGetIndex(Box* arrayValue, int64_t index) {
-    Array* array = unbox(LAARRAY, arrayValue);
-    assert(array->length > index);
-    return array->data[index];
+    switch (laTypeOf(arrayValue)->id) {
+      case LATYPE_ID_INTARRAY: {
+        IntArray* array = asIntArray(arrayValue);
+        assert(array->length > index);
+        return boxInt(array->data[index]);
+      }
+      case LATYPE_ID_FLOATARRAY: {
+        FloatArray* array = asFloatArray(arrayValue);
+        assert(array->length > index);
+        return (Box*) boxFloat64(array->data[index]);
+      }
+      default: {
+        Array* array = unbox(LAARRAY, arrayValue);
+        assert(array->length > index);
+        return array->data[index];
+      }
+    }
 }
 
 Box* arraySetIndex(Box* arrayValue, int64_t index, Box* value) {
-    Array* array = unbox(LAARRAY, arrayValue);
-    assert(array->length > index);
-    array->data[index] = value;
+    switch (laTypeOf(arrayValue)->id) {
+      case LATYPE_ID_INTARRAY: {
+        IntArray* array = asIntArray(arrayValue);
+        assert(array->length > index);
+        array->data[index] = intValue(unbox(LAINT, value));
+        break;
+      }
+      case LATYPE_ID_FLOATARRAY: {
+        FloatArray* array = asFloatArray(arrayValue);
+        assert(array->length > index);
+        array->data[index] = asFloat(unbox(LAFLOAT64, value))->num;
+        break;
+      }
+      default: {
+        Array* array = unbox(LAARRAY, arrayValue);
+        assert(array->length > index);
+        array->data[index] = value;
+        gcWriteBarrier(array, &array->data[index]);
+      }
+    }
     return &UNIT_SINGLETON;
 }
 
@@ -247,15 +417,43 @@ Box* arrayInit(int64_t size, Box* f) {
     return box(LAARRAY, array);
 }
 
+Box* intArrayInit(int64_t size, Box* f) {
+    IntArray* array = createIntArray(size);
+    Position pos = {0, 0};
+    for (int64_t i = 0; i < size; i++) {
+        Box* argv[1];
+        argv[0] = (Box*) boxInt(i);
+        array->data[i] = intValue(unbox(LAINT, runtimeApply(f, 1, argv, pos)));
+    }
+    return (Box*) array;
+}
+
+Box* floatArrayInit(int64_t size, Box* f) {
+    FloatArray* array = createFloatArray(size);
+    Position pos = {0, 0};
+    for (int64_t i = 0; i < size; i++) {
+        Box* argv[1];
+        argv[0] = (Box*) boxInt(i);
+        array->data[i] = asFloat(unbox(LAFLOAT64, runtimeApply(f, 1, argv, pos)))->num;
+    }
+    return (Box*) array;
+}
+
 int64_t arrayLength(Box* arrayValue) {
-    Array* array = unbox(LAARRAY, arrayValue);
-    return array->length;
+    switch (laTypeOf(arrayValue)->id) {
+      case LATYPE_ID_INTARRAY: return asIntArray(arrayValue)->length;
+      case LATYPE_ID_FLOATARRAY: return asFloatArray(arrayValue)->length;
+      default: {
+        Array* array = unbox(LAARRAY, arrayValue);
+        return array->length;
+      }
+    }
 }
 
 Box* createByteArray(size_t size) {
-    String* val = gcMalloc(sizeof(String) + size);
-    val->length = size;
-    return box(LABYTEARRAY, val);
+    String* val = gcMallocString(LABYTEARRAY, size);
+    memset(val->bytes, 0, size);
+    return (Box*) val;
 }
 
 int64_t byteArrayLength(Box* value) {
@@ -309,8 +507,7 @@ Box* lascaReadFile(Box* filename) {
     struct stat st;
     fstat(fileno(f), &st);
     size_t size = st.st_size;
-    String *s = gcMalloc(sizeof(String) + size + 1);
-    s->length = size;
+    String *s = gcMallocString(LASTRING, size);
     size_t read = fread(s->bytes, size, 1, f);
     if (read != 1) {
         printf("AAAA!!! lascaReadFile: Expected to read %zu bytes, but read only %zu: %s\n", size, read, strerror(errno));
@@ -373,8 +570,9 @@ Pattern* lascaCompileRegex(Box* ptrn) {
         printf("PCRE2 compilation failed at offset %d: %s\n", (int)erroroffset, buffer);
         exit(1);
     }
-    Pattern* boxedRe = gcMalloc(sizeof(Pattern));
-    boxedRe->type = LAPATTERN;
+    // always on the GC heap, never in an arena: finalizers need GC objects
+    Pattern* boxedRe = GC_malloc_atomic(sizeof(Pattern));
+    boxedRe->header = HEADER(LAPATTERN);
     boxedRe->re = re;
     GC_register_finalizer(boxedRe, (GC_finalization_proc)finalizePcre2Code, 0, 0, 0);
     return boxedRe;
@@ -413,7 +611,7 @@ Box* lascaRegexReplace(Box* ptrn, Box* string, Box* replace) {
     uint32_t options = PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH;
     size_t len = subject->length * 1.2; // approximate
     PCRE2_SIZE outlengthptr = len;
-    String* val = gcMalloc(sizeof(String) + len + 1);  // null terminated
+    String* val = gcMallocString(LASTRING, len);
 
     int rc = pcre2_substitute(re, (PCRE2_SPTR) subject->bytes, subject->length, 0, options, 0, 0,
                 (PCRE2_SPTR) subst->bytes, subst->length, (PCRE2_UCHAR *) val->bytes, &outlengthptr);
@@ -423,11 +621,11 @@ Box* lascaRegexReplace(Box* ptrn, Box* string, Box* replace) {
                 // len, outlengthptr, subst->bytes);
         // outlengthptr should contain required length in code units, bytes here,
         // including space for trailing zero, see https://www.pcre.org/current/doc/html/pcre2api.html#SEC36
-        val = gcMalloc(sizeof(String) + outlengthptr);
+        val = gcMallocString(LASTRING, outlengthptr);
         rc = pcre2_substitute(re, (PCRE2_SPTR) subject->bytes, subject->length, 0, options, 0, 0,
                 (PCRE2_SPTR) subst->bytes, subst->length, (PCRE2_UCHAR *) val->bytes, &outlengthptr);
     }
-    val->type = LASTRING;
+    val->header = HEADER(LASTRING);
     val->length = outlengthptr;
 
     if (rc < 0) {
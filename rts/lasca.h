@@ -27,78 +27,193 @@ static const int64_t ZNOT = 50;                          // !x
 static const int64_t ZOR = 60;                           // x || y
 static const int64_t ZAND = 61;                          // x && y
 
+/*
+  Every type has a unique numeric id, so type checks and dispatch are integer comparisons.
+  Builtin types have fixed ids. Data types get FIRST_DATA_TYPE_ID + their index in Runtime.types,
+  assigned by the compiler (see genTypeStruct in EmitCommon.hs).
+  C side definitions of Lasca data types (Var, Option, Pattern, FileHandle)
+  get the id of the matching compiled data type in initLascaRuntime.
+*/
+enum {
+    LATYPE_ID_UNKNOWN = 0,
+    LATYPE_ID_UNIT,
+    LATYPE_ID_BOOL,
+    LATYPE_ID_BYTE,
+    LATYPE_ID_INT16,
+    LATYPE_ID_INT32,
+    LATYPE_ID_INT,
+    LATYPE_ID_FLOAT64,
+    LATYPE_ID_STRING,
+    LATYPE_ID_CLOSURE,
+    LATYPE_ID_ARRAY,
+    LATYPE_ID_BYTEARRAY,
+    LATYPE_ID_INTARRAY,
+    LATYPE_ID_FLOATARRAY,
+    LATYPE_ID_SYMBOL,
+    // placeholders until resolved by initLascaRuntime
+    LATYPE_ID_VAR,
+    LATYPE_ID_OPTION,
+    LATYPE_ID_PATTERN,
+    LATYPE_ID_FILE_HANDLE,
+    FIRST_DATA_TYPE_ID = 19 // Keep in sync with firstDataTypeId in Codegen.hs
+};
+
+// Keep in sync with LaTypeKind in EmitCommon.hs
+enum {
+    LATYPE_KIND_BUILTIN = 0, // runtime types: Int, String, Array etc.
+    LATYPE_KIND_DATA    = 1, // algebraic data types, values are DataValue
+    LATYPE_KIND_OPAQUE  = 2  // types without constructors, values are created in C, e.g. Pattern
+};
+
+struct Data;
+
 typedef struct {
     const char* name;
+    int32_t id;
+    int32_t kind;
+    struct Data* data; // data type descriptor with constructors and fields, NULL for builtin types
 } LaType;
 
+/*
+  Compact 8 byte header of every heap object: the LaType id and, for data values, the constructor tag.
+  LaType of an id is in the type registry, see laTypeOf.
+  Keep in sync with headerType and dataValueStructType in Codegen.hs
+*/
+typedef struct {
+    int32_t typeId;
+    int32_t tag; // constructor tag of a DataValue, cached code point count of a String, 0 for other objects
+} Header;
+
+#define HEADER(laType) ((Header) {.typeId = (laType)->id, .tag = 0})
+
 typedef struct {
-    const LaType* type;
+    Header header;
     void* fields[];
 } Box;
 
 typedef Box Unit;
 
-typedef struct {
-    const LaType* type;
-    int8_t num;
-} Byte;
+/*
+  Tagged immediate values.
+  Heap objects are at least 8 bytes aligned, so the two lowest bits of a real Box* are always zero.
+  We use them to encode small values directly in the pointer:
+    ...xxx1 - Int, 63-bit signed value in the upper bits
+    ...xx10 - Bool, Byte, Int16 or Int32: kind in bits 2..7, value in the upper 32 bits
+  Ints that don't fit into 63 bits are heap allocated Int boxes.
+*/
+#define IMMEDIATE_INT_TAG 1
+#define IMMEDIATE_TAG 2
+#define IMMEDIATE_KIND_SHIFT 2
+#define IMMEDIATE_VALUE_SHIFT 32
+#define IMMEDIATE_INT_MIN (INT64_MIN >> 1)
+#define IMMEDIATE_INT_MAX (INT64_MAX >> 1)
+
+// Keep in sync with immediateKind in EmitCommon.hs
+enum {
+    IMMEDIATE_BOOL  = 0,
+    IMMEDIATE_BYTE  = 1,
+    IMMEDIATE_INT16 = 2,
+    IMMEDIATE_INT32 = 3
+};
+
+#define isImmediate(ptr) (((uintptr_t) (ptr)) & 3)
+#define isImmediateInt(ptr) (((uintptr_t) (ptr)) & IMMEDIATE_INT_TAG)
+#define immediateKind(ptr) ((((uintptr_t) (ptr)) >> IMMEDIATE_KIND_SHIFT) & 0x3f)
+#define immediateValue(ptr) ((int32_t) (((intptr_t) (ptr)) >> IMMEDIATE_VALUE_SHIFT))
+#define makeImmediate(kind, value) \
+    ((Box*) ((((uint64_t) (uint32_t) (value)) << IMMEDIATE_VALUE_SHIFT) | ((kind) << IMMEDIATE_KIND_SHIFT) | IMMEDIATE_TAG))
 
 typedef struct {
-    const LaType* type;
+    Header header;
     int64_t num;
 } Int;
 
 typedef struct {
-    const LaType* type;
-    int16_t num;
-} Int16;
-
-typedef struct {
-    const LaType* type;
-    int32_t num;
-} Int32;
-
-typedef Byte Bool;
-
-typedef struct {
-    const LaType* type;
+    Header header;
     double num;
 } Float64;
 
+/*
+  UTF-8 encoded, length is in bytes. The header tag of a String caches its code point count + 1,
+  0 means not counted yet, see stringCodePointCount. A String is ASCII if it has as many code points as bytes.
+  ByteArray has the same layout, without the cache.
+  Keep in sync with createString in Codegen.hs
+*/
 typedef struct {
-    const LaType* type;
+    Header header;
     int64_t length;
     char bytes[];
 } String;
 
+/*
+  Flat closure: enclosed values are allocated inline, funcPtr and arity are copied
+  from the Functions table, so known calls don't need to look the function up.
+  Keep in sync with closureStructType in Codegen.hs and cgenCallClosure in EmitCommon.hs
+*/
 typedef struct {
-    const LaType* type;
+    Header header;
     int64_t funcIdx;
-    int64_t argc;
-    Box** argv;
+    void* funcPtr;
+    int64_t arity; // of funcPtr, enclosed values included
+    int64_t argc;  // number of enclosed values
+    Box* argv[];
 } Closure;
 
 typedef struct {
-    const LaType* type;
+    Header header;
     int64_t length;
     Box* data[];
 } Array;
 
+/*
+  Arrays of Int and Float with raw contiguous storage. Allocated pointer-free, the GC never scans them.
+  Both are Array Int / Array Float in Lasca, the representation is chosen when the array is created.
+  Keep in sync with cgenArrayApply in EmitStatic.hs
+*/
+typedef struct {
+    Header header;
+    int64_t length;
+    int64_t data[];
+} IntArray;
+
+typedef struct {
+    Header header;
+    int64_t length;
+    double data[];
+} FloatArray;
+
 typedef struct {
-    const LaType* type;
-    int64_t tag;
+    Header header;
     Box* values[];
 } DataValue;
 
+/*
+  Interned string. There is one Symbol per distinct name, so equal symbols are the same object.
+  Symbols known at compile time, field names and String.intern literals, are static: their id is
+  the compile time symbol id, see genSymbols in EmitCommon.hs. Symbols interned at runtime get the next ids.
+  Keep in sync with symbolStructType in Codegen.hs
+*/
+typedef struct {
+    Header header;
+    int64_t hash; // lascaHashCode of the name
+    int64_t id;   // symbols compare by it, i.e. in interning order
+    String* name;
+} Symbol;
+
+typedef struct {
+    int64_t size;
+    Symbol* symbols[];
+} Symbols;
+
 typedef DataValue Option;
 
 typedef struct {
-    const LaType* type;
+    Header header;
     String* error;
 } Unknown;
 
 typedef struct {
-    const LaType* type;
+    Header header;
     pcre2_code *re;
 } Pattern;
 
@@ -113,15 +228,40 @@ typedef struct {
     Function functions[];
 } Functions;
 
+/*
+  Layout of data value fields. In static mode Int, Float, Bool and Byte fields are stored
+  as raw int64_t, double and int8_t in their DataValue.values slot instead of a Box*.
+  Use dataValueField to read a field of any kind.
+  Keep in sync with FieldKind in EmitCommon.hs
+*/
+enum {
+    FIELD_BOXED = 0,
+    FIELD_INT   = 1,
+    FIELD_FLOAT = 2,
+    FIELD_BOOL  = 3,
+    FIELD_BYTE  = 4
+};
+
 typedef struct {
     LaType* type;
   //  int64_t tag;   // it's not set now. Not sure we need this
     String* name;
+    int64_t* fieldIds; // compile time symbol ids of field names, see collectFieldSymbolIds in EmitCommon.hs
+    int64_t* fieldKinds; // FIELD_* of every field
     int64_t numFields;
     String* fields[];
 } Struct;
 
+/*
+  Field select site inline cache: data values of this type and tag have the field at slot.
+  Keep in sync with cgenSelectField in EmitDynamic.hs
+*/
 typedef struct {
+    Header header; // of cached data values, typeId -1 when empty
+    int64_t slot;
+} SelectCacheEntry;
+
+typedef struct Data {
     LaType* type;
     String* name;
     int64_t numValues;
@@ -141,6 +281,7 @@ typedef struct {
 typedef struct {
     Functions* functions;
     Types* types;
+    Symbols* symbols;
     int8_t verbose;
 } Runtime;
 
@@ -149,21 +290,18 @@ typedef struct {
     int64_t column;
 } Position;
 
-#define asBool(ptr) ((Bool*)ptr)
-#define asByte(ptr) ((Byte*)ptr)
 #define asInt(ptr) ((Int*)ptr)
-#define asInt16(ptr) ((Int16*)ptr)
-#define asInt32(ptr) ((Int32*)ptr)
 #define asFloat(ptr) ((Float64*)ptr)
 #define asString(ptr) ((String*)ptr)
 #define asDataValue(ptr) ((DataValue*)ptr)
 #define asClosure(ptr) ((Closure*)ptr)
 #define asArray(ptr) ((Array*)ptr)
+#define asIntArray(ptr) ((IntArray*)ptr)
+#define asFloatArray(ptr) ((FloatArray*)ptr)
 #define asByteArray(ptr) ((String*)ptr)
+#define asSymbol(ptr) ((Symbol*)ptr)
 
 extern Unit UNIT_SINGLETON;
-extern Bool TRUE_SINGLETON;
-extern Bool FALSE_SINGLETON;
 extern DataValue NONE;
 // Primitive Types
 extern const LaType* LAUNIT   ;
@@ -177,18 +315,65 @@ extern const LaType* LASTRING ;
 extern const LaType* LACLOSURE;
 extern const LaType* LAARRAY  ;
 extern const LaType* LABYTEARRAY;
+extern const LaType* LAINTARRAY;
+extern const LaType* LAFLOATARRAY;
+extern const LaType* LASYMBOL;
 extern const LaType* LAFILE_HANDLE;
 extern const LaType* LAPATTERN;
 extern const LaType* LAOPTION;
 extern unsigned long long xxHashSeed;
-
-bool eqTypes(const LaType* lhs, const LaType* rhs);
+extern const LaType** TYPE_REGISTRY;
+
+static inline const LaType* laTypeOf(const Box* value) {
+    if (isImmediateInt(value)) return LAINT;
+    if (isImmediate(value)) {
+        switch (immediateKind(value)) {
+            case IMMEDIATE_BOOL: return LABOOL;
+            case IMMEDIATE_BYTE: return LABYTE;
+            case IMMEDIATE_INT16: return LAINT16;
+            default: return LAINT32;
+        }
+    }
+    return TYPE_REGISTRY[value->header.typeId];
+}
+
+static inline int64_t intValue(const Box* value) {
+    return isImmediateInt(value) ? ((intptr_t) value) >> 1 : asInt(value)->num;
+}
+
+#define boolValue(ptr) ((int8_t) immediateValue(ptr))
+#define byteValue(ptr) ((int8_t) immediateValue(ptr))
+#define int16Value(ptr) ((int16_t) immediateValue(ptr))
+#define int32Value(ptr) ((int32_t) immediateValue(ptr))
+
+static inline bool eqTypes(const LaType* lhs, const LaType* rhs) {
+    return lhs->id == rhs->id;
+}
+
+const LaType* typeById(int32_t id);
+
+// Keep in sync with granuleBytes and smallObjectClasses in EmitCommon.hs
+#define GRANULE_BYTES 16
+#define SMALL_OBJECT_CLASSES 16
+extern void* LASCA_FREE_LISTS[SMALL_OBJECT_CLASSES + 1];
+void *gcMallocRefill(int64_t sizeClass);
+extern bool LASCA_WRITE_BARRIER;
+void gcWriteBarrier(void* obj, Box** slot);
+Box* withArena(Box* f);
 void *gcMalloc(size_t s);
+void *gcMallocAtomic(size_t s);
+void *gcMallocData(int32_t typeId, int32_t tag, size_t s);
+String* gcMallocString(const LaType* type, size_t length);
+int64_t stringCodePointCount(String* str);
+void resetStringCursor(void);
 String* __attribute__ ((pure)) makeString(const char * str);
 Box *box(const LaType* type_id, void *value);
-Int* boxInt(int64_t i);
-Int16* boxInt16(int16_t i);
-Int32* boxInt32(int32_t i);
+Box* boxBool(int8_t i);
+Box* boxByte(int8_t i);
+Box* boxInt(int64_t i);
+Box* boxInt16(int16_t i);
+Box* boxInt32(int32_t i);
+Float64* boxFloat64(double i);
 void * unbox(const LaType* expected, const Box* ti);
 int64_t runtimeCompare(Box* lhs, Box* rhs);
 Box* runtimeApply(Box* val, int64_t argc, Box* argv[], Position pos);
@@ -196,7 +381,15 @@ String* toString(const Box* value);
 Box* println(const Box* val);
 Box* boxArray(size_t size, ...);
 Array* createArray(size_t size);
+IntArray* createIntArray(size_t size);
+FloatArray* createFloatArray(size_t size);
+int64_t arrayLength(Box* arrayValue);
+Box* arrayGetIndex(Box* arrayValue, int64_t index);
+Box* arraySetIndex(Box* arrayValue, int64_t index, Box* value);
+Box* arrayCopy(Box* src, int64_t srcPos, Box* dest, int64_t destPos, int64_t length);
 const char * __attribute__ ((const)) typeIdToName(const LaType* typeId);
 DataValue* some(Box* value);
+Symbol* intern(const char* bytes, int64_t length);
+Box* dataValueField(const DataValue* value, const Struct* constr, int64_t i);
 
 #endif
\ No newline at end of file
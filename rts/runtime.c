@@ -1,5 +1,6 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,29 +9,34 @@
 #include <string.h>
 #include <math.h>
 #include <gc.h>
+#include <gc_typed.h>
 #include <ffi.h>
 #include <utf8proc.h>
 #include "lasca.h"
 
-#define STR(s) {.type = &String_LaType, .length = sizeof(s) - 1, .bytes = s}
+#define STR(s) {.header = {.typeId = LATYPE_ID_STRING}, .length = sizeof(s) - 1, .bytes = s}
 
 // Primitive Types
-const LaType Unknown_LaType = { .name = "Unknown" };
-const LaType Unit_LaType    = { .name = "Unit" };
-const LaType Bool_LaType    = { .name = "Bool" };
-const LaType Byte_LaType    = { .name = "Byte" };
-const LaType Int16_LaType   = { .name = "Int16" };
-const LaType Int32_LaType   = { .name = "Int32" };
-const LaType Int_LaType     = { .name = "Int" };
-const LaType Float_LaType   = { .name = "Float" };
-const LaType String_LaType  = { .name = "String" };
-const LaType Closure_LaType = { .name = "Closure" };
-const LaType Array_LaType   = { .name = "Array" };
-const LaType ByteArray_LaType     = { .name = "ByteArray" };
-const LaType _VAR     = { .name = "Var" };
-const LaType _FILE_HANDLE   = { .name = "FileHandle" };
-const LaType _PATTERN = { .name = "Pattern" };
-const LaType _OPTION =  { .name = "Option" };
+const LaType Unknown_LaType = { .name = "Unknown", .id = LATYPE_ID_UNKNOWN, .kind = LATYPE_KIND_BUILTIN };
+const LaType Unit_LaType    = { .name = "Unit",    .id = LATYPE_ID_UNIT,    .kind = LATYPE_KIND_BUILTIN };
+const LaType Bool_LaType    = { .name = "Bool",    .id = LATYPE_ID_BOOL,    .kind = LATYPE_KIND_BUILTIN };
+const LaType Byte_LaType    = { .name = "Byte",    .id = LATYPE_ID_BYTE,    .kind = LATYPE_KIND_BUILTIN };
+const LaType Int16_LaType   = { .name = "Int16",   .id = LATYPE_ID_INT16,   .kind = LATYPE_KIND_BUILTIN };
+const LaType Int32_LaType   = { .name = "Int32",   .id = LATYPE_ID_INT32,   .kind = LATYPE_KIND_BUILTIN };
+const LaType Int_LaType     = { .name = "Int",     .id = LATYPE_ID_INT,     .kind = LATYPE_KIND_BUILTIN };
+const LaType Float_LaType   = { .name = "Float",   .id = LATYPE_ID_FLOAT64, .kind = LATYPE_KIND_BUILTIN };
+const LaType String_LaType  = { .name = "String",  .id = LATYPE_ID_STRING,  .kind = LATYPE_KIND_BUILTIN };
+const LaType Closure_LaType = { .name = "Closure", .id = LATYPE_ID_CLOSURE, .kind = LATYPE_KIND_BUILTIN };
+const LaType Array_LaType   = { .name = "Array",   .id = LATYPE_ID_ARRAY,   .kind = LATYPE_KIND_BUILTIN };
+const LaType ByteArray_LaType     = { .name = "ByteArray", .id = LATYPE_ID_BYTEARRAY, .kind = LATYPE_KIND_BUILTIN };
+const LaType IntArray_LaType      = { .name = "IntArray", .id = LATYPE_ID_INTARRAY, .kind = LATYPE_KIND_BUILTIN };
+const LaType FloatArray_LaType    = { .name = "FloatArray", .id = LATYPE_ID_FLOATARRAY, .kind = LATYPE_KIND_BUILTIN };
+const LaType Symbol_LaType  = { .name = "Symbol",  .id = LATYPE_ID_SYMBOL,  .kind = LATYPE_KIND_BUILTIN };
+// Lasca data types used from C. Not const: initLascaRuntime sets the id of the compiled data type
+LaType _VAR     = { .name = "Var",        .id = LATYPE_ID_VAR,         .kind = LATYPE_KIND_DATA };
+LaType _FILE_HANDLE   = { .name = "FileHandle", .id = LATYPE_ID_FILE_HANDLE, .kind = LATYPE_KIND_OPAQUE };
+LaType _PATTERN = { .name = "Pattern",    .id = LATYPE_ID_PATTERN,     .kind = LATYPE_KIND_OPAQUE };
+LaType _OPTION =  { .name = "Option",     .id = LATYPE_ID_OPTION,      .kind = LATYPE_KIND_DATA };
 const LaType* UNKNOWN = &Unknown_LaType;
 const LaType* LAUNIT    = &Unit_LaType;
 const LaType* LABOOL    = &Bool_LaType;
@@ -44,49 +50,34 @@ const LaType* LACLOSURE = &Closure_LaType;
 const LaType* LAARRAY   = &Array_LaType;
 const LaType* VAR     = &_VAR;
 const LaType* LABYTEARRAY   = &ByteArray_LaType;
+const LaType* LAINTARRAY    = &IntArray_LaType;
+const LaType* LAFLOATARRAY  = &FloatArray_LaType;
+const LaType* LASYMBOL      = &Symbol_LaType;
 const LaType* LAFILE_HANDLE = &_FILE_HANDLE;
 const LaType* LAPATTERN = &_PATTERN;
 const LaType* LAOPTION  = &_OPTION;
 
-Bool TRUE_SINGLETON = {
-    .type = &Bool_LaType,
-    .num = 1
-};
-
-Bool FALSE_SINGLETON = {
-    .type = &Bool_LaType,
-    .num = 0
-};
-
 Unit UNIT_SINGLETON = {
-    .type = &Unit_LaType
+    .header = {.typeId = LATYPE_ID_UNIT}
 };
 String EMPTY_STRING = STR("\00");
 String* UNIT_STRING;
-Byte BYTE_ARRAY[256];
-Int INT_ARRAY[100];
 Float64 FLOAT64_ZERO = {
-    .type = &Float_LaType,
+    .header = {.typeId = LATYPE_ID_FLOAT64},
     .num = 0.0
 };
 
 DataValue NONE = {
-    .type = &_OPTION,
-    .tag = 0,
+    .header = {.typeId = LATYPE_ID_OPTION, .tag = 0}, // id is resolved in initLascaRuntime
     .values = {}
 };
 Environment ENV;
 Runtime* RUNTIME;
 
-bool eqTypes(const LaType* lhs, const LaType* rhs) {
-    return lhs == rhs || strcmp(lhs->name, rhs->name) == 0;
-}
-
 Option* some(Box* value) {
     assert(value != NULL);
     DataValue* dv = gcMalloc(sizeof(DataValue) + sizeof(Box*));
-    dv->type = LAOPTION;
-    dv->tag = 1;
+    dv->header = (Header) {.typeId = LAOPTION->id, .tag = 1};
     dv->values[0] = value;
     return dv;
 }
@@ -94,18 +85,377 @@ Option* some(Box* value) {
 static uint64_t Lasca_Allocated = 0;
 static uint64_t Lasca_Nr_gcMalloc = 0;
 
+/*
+    Arenas, see withArena. While one is active every gcMalloc* call bump allocates from its chunks.
+    Chunks are uncollectable GC objects: the GC scans them for pointers, but only withArena frees them.
+    Arenas nest, depth 1 is the outermost one, 0 stands for the GC heap.
+*/
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    char* end;
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    struct Arena* parent;
+    int64_t depth;
+    ArenaChunk* chunks; // the current chunk first
+    char* next;         // bump pointer into the current chunk
+    size_t chunkSize;   // of the next chunk, doubles up to ARENA_MAX_CHUNK
+    void* savedFreeLists[SMALL_OBJECT_CLASSES + 1];
+} Arena;
+
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (4 * 1024 * 1024)
+
+static Arena* ARENA = NULL; // the innermost active arena
+
+static void* arenaAlloc(Arena* arena, size_t s) {
+    size_t size = (s + GRANULE_BYTES - 1) & ~((size_t) GRANULE_BYTES - 1);
+    if (arena->chunks == NULL || size > (size_t) (arena->chunks->end - arena->next)) {
+        size_t chunkSize = size > arena->chunkSize ? size : arena->chunkSize;
+        ArenaChunk* chunk = GC_malloc_uncollectable(sizeof(ArenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            printf("AAAA!!! Out of memory allocating %zu bytes arena chunk\n", chunkSize);
+            exit(1);
+        }
+        chunk->next = arena->chunks;
+        chunk->end = chunk->data + chunkSize;
+        arena->chunks = chunk;
+        arena->next = chunk->data;
+        if (arena->chunkSize < ARENA_MAX_CHUNK) arena->chunkSize *= 2;
+    }
+    void* obj = arena->next;
+    arena->next += size;
+    Lasca_Allocated += s;
+    Lasca_Nr_gcMalloc++;
+    return obj; // chunks come cleared from the GC and are never reused
+}
+
+static Box* arenaEscape(void* obj, Box* value);
+
+/*
+    Small objects are handed out from free lists, one per size class of GRANULE_BYTES,
+    which GC_malloc_many fills with cleared objects linked through their first word.
+    Codegen pops them inline, see gcMallocType in EmitCommon.hs.
+    The lists are roots the GC scans, so the objects on them stay allocated until handed out.
+    The runtime is single threaded, the lists are plain globals.
+    Allocation statistics count the objects when a list is refilled.
+*/
+void* LASCA_FREE_LISTS[SMALL_OBJECT_CLASSES + 1];
+
+void *gcMallocRefill(int64_t sizeClass) {
+    size_t size = sizeClass * GRANULE_BYTES;
+    // withArena empties the lists, so inline allocations in an arena end up here
+    if (ARENA != NULL) return arenaAlloc(ARENA, size);
+    void* obj = GC_malloc_many(size);
+    if (obj == NULL) {
+        printf("AAAA!!! Out of memory allocating %zu bytes\n", size);
+        exit(1);
+    }
+    for (void* p = obj; p != NULL; p = GC_NEXT(p)) {
+        Lasca_Allocated += size;
+        Lasca_Nr_gcMalloc++;
+    }
+    LASCA_FREE_LISTS[sizeClass] = GC_NEXT(obj);
+    GC_NEXT(obj) = NULL;
+    return obj;
+}
+
 void *gcMalloc(size_t s) {
+    if (ARENA != NULL) return arenaAlloc(ARENA, s);
+    size_t sizeClass = (s + GRANULE_BYTES - 1) / GRANULE_BYTES;
+    if (s > 0 && sizeClass <= SMALL_OBJECT_CLASSES) {
+        void* obj = LASCA_FREE_LISTS[sizeClass];
+        if (obj == NULL) return gcMallocRefill(sizeClass);
+        LASCA_FREE_LISTS[sizeClass] = GC_NEXT(obj);
+        GC_NEXT(obj) = NULL;
+        return obj;
+    }
     Lasca_Allocated += s;
     Lasca_Nr_gcMalloc++;
     return GC_malloc(s);
 }
 
 void *gcMallocAtomic(size_t s) {
+    if (ARENA != NULL) return arenaAlloc(ARENA, s);
     Lasca_Allocated += s;
     Lasca_Nr_gcMalloc++;
     return GC_malloc_atomic(s);
 }
 
+/*
+    Stores of pointers into existing heap objects call gcWriteBarrier while an arena is active,
+    it keeps values from escaping the arena, see withArena.
+    Codegen tests LASCA_WRITE_BARRIER inline before calling it, see cgenWriteBarrier in EmitCommon.hs
+    Incremental marking (the -G RTS option) needs no barrier: Boehm finds the objects written to
+    by the dirty bits of their heap pages, which it tracks itself.
+*/
+bool LASCA_WRITE_BARRIER = false; // an arena is active
+
+void gcWriteBarrier(void* obj, Box** slot) {
+    if (ARENA != NULL) *slot = arenaEscape(obj, *slot);
+}
+
+/*
+    GC descriptors of data values, by data type index and constructor tag.
+    Only the slots of boxed fields are traced: the header and raw Int, Float, Bool and Byte fields aren't pointers.
+    Codegen allocates data values with only boxed fields with gcMalloc and without any with gcMallocAtomic,
+    see gcMallocDataValue in EmitCommon.hs
+*/
+static GC_descr** DATA_DESCRIPTORS;
+
+static void initDataDescriptors(Types* types) {
+    DATA_DESCRIPTORS = GC_malloc_uncollectable(sizeof(GC_descr*) * types->size);
+    for (int64_t i = 0; i < types->size; i++) {
+        Data* data = types->data[i];
+        DATA_DESCRIPTORS[i] = GC_malloc_uncollectable(sizeof(GC_descr) * data->numValues);
+        for (int64_t tag = 0; tag < data->numValues; tag++) {
+            Struct* constr = data->constructors[tag];
+            size_t words = 1 + constr->numFields; // header, then a slot per field
+            GC_word bitmap[(words + GC_WORDSZ - 1) / GC_WORDSZ];
+            memset(bitmap, 0, sizeof(bitmap));
+            for (int64_t field = 0; field < constr->numFields; field++) {
+                if (constr->fieldKinds[field] == FIELD_BOXED) GC_set_bit(bitmap, 1 + field);
+            }
+            DATA_DESCRIPTORS[i][tag] = GC_make_descriptor(bitmap, words);
+        }
+    }
+}
+
+void *gcMallocData(int32_t typeId, int32_t tag, size_t s) {
+    int32_t idx = typeId - FIRST_DATA_TYPE_ID;
+    if (idx < 0 || idx >= RUNTIME->types->size || tag < 0 || tag >= RUNTIME->types->data[idx]->numValues) {
+        printf("AAAA!!! No data type with id %"PRId32" and tag %"PRId32"\n", typeId, tag);
+        exit(1);
+    }
+    if (ARENA != NULL) return arenaAlloc(ARENA, s);
+    Lasca_Allocated += s;
+    Lasca_Nr_gcMalloc++;
+    return GC_malloc_explicitly_typed(s, DATA_DESCRIPTORS[idx][tag]);
+}
+
+/*
+    Strings and byte arrays hold no pointers, so they are allocated atomic: the GC doesn't scan them.
+    GC_malloc_atomic doesn't clear memory. The header and the length are set here,
+    and the byte after length is zero, so the bytes are null terminated once filled.
+*/
+String* gcMallocString(const LaType* type, size_t length) {
+    String* s = gcMallocAtomic(sizeof(String) + length + 1);
+    s->header = HEADER(type);
+    s->length = length;
+    s->bytes[length] = 0;
+    return s;
+}
+
+/*
+    withArena(f) calls f(()) with a fresh arena active, and frees the whole arena when f returns.
+    Nothing may point into a freed arena, so values leave an arena only as copies:
+    the result of f, and values stored into objects outside the arena, see gcWriteBarrier.
+    A copy takes along everything it reaches in the arena.
+    Copying the result is always safe, nothing in the arena is used after f returns.
+    A store runs while f still may write through its references, so a Var or an array
+    copied by a store would silently stop seeing those writes: such a store is an error.
+    Invariant: no object points into an arena deeper than its own.
+*/
+static int64_t arenaDepth(const void* ptr) {
+    if (isImmediate(ptr)) return 0;
+    for (Arena* arena = ARENA; arena != NULL; arena = arena->parent) {
+        for (ArenaChunk* chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+            if ((const char*) ptr >= chunk->data && (const char*) ptr < chunk->end) return arena->depth;
+        }
+    }
+    return 0;
+}
+
+static size_t arenaObjectSize(const Box* value, bool* pointerFree) {
+    const LaType* type = laTypeOf(value);
+    *pointerFree = true;
+    switch (type->id) {
+        case LATYPE_ID_INT: return sizeof(Int);
+        case LATYPE_ID_FLOAT64: return sizeof(Float64);
+        case LATYPE_ID_STRING:
+        case LATYPE_ID_BYTEARRAY: return sizeof(String) + asString(value)->length + 1;
+        case LATYPE_ID_INTARRAY: return sizeof(IntArray) + asIntArray(value)->length * sizeof(int64_t);
+        case LATYPE_ID_FLOATARRAY: return sizeof(FloatArray) + asFloatArray(value)->length * sizeof(double);
+    }
+    *pointerFree = false;
+    switch (type->id) {
+        case LATYPE_ID_ARRAY: return sizeof(Array) + asArray(value)->length * sizeof(Box*);
+        case LATYPE_ID_CLOSURE: return sizeof(Closure) + asClosure(value)->argc * sizeof(Box*);
+        case LATYPE_ID_UNKNOWN: return sizeof(Unknown);
+    }
+    if (type->kind == LATYPE_KIND_DATA) {
+        return sizeof(DataValue) + type->data->constructors[value->header.tag]->numFields * sizeof(Box*);
+    }
+    printf("AAAA!!! Can't copy %s value out of an arena\n", type->name);
+    exit(1);
+}
+
+typedef struct {
+    Arena* target;    // where copies go, NULL for the GC heap
+    int64_t minDepth; // objects in arenas at least this deep are copied
+    bool store;       // copying a stored value, Vars and arrays can't be copied
+    // open addressing table of copied objects, so that sharing and cycles are preserved
+    Box** from;
+    Box** to;
+    size_t capacity;
+    size_t count;
+    // copies whose fields still point into the arena
+    Box** pending;
+    size_t numPending;
+    size_t pendingCapacity;
+} Evacuation;
+
+static void evacuationRemember(Evacuation* ev, Box* value, Box* copy) {
+    size_t i = ((uintptr_t) value / GRANULE_BYTES) & (ev->capacity - 1);
+    while (ev->from[i] != NULL) i = (i + 1) & (ev->capacity - 1);
+    ev->from[i] = value;
+    ev->to[i] = copy;
+    ev->count++;
+}
+
+static bool isMutable(const LaType* type) {
+    // Var is a compiled data type, initTypeRegistry gives _VAR its id
+    if (type == VAR || type->id == VAR->id) return true;
+    switch (type->id) {
+        case LATYPE_ID_ARRAY:
+        case LATYPE_ID_BYTEARRAY:
+        case LATYPE_ID_INTARRAY:
+        case LATYPE_ID_FLOATARRAY: return true;
+        default: return false;
+    }
+}
+
+static Box* evacuationCopy(Evacuation* ev, Box* value) {
+    if (arenaDepth(value) < ev->minDepth) return value;
+    for (size_t i = ((uintptr_t) value / GRANULE_BYTES) & (ev->capacity - 1); ev->from[i] != NULL; i = (i + 1) & (ev->capacity - 1)) {
+        if (ev->from[i] == value) return ev->to[i];
+    }
+    if (ev->store && isMutable(laTypeOf(value))) {
+        printf("AAAA!!! %s created in withArena can't be stored into a value from outside of the arena\n", laTypeOf(value)->name);
+        exit(1);
+    }
+    bool pointerFree;
+    size_t size = arenaObjectSize(value, &pointerFree);
+    Box* copy;
+    if (ev->target != NULL) copy = arenaAlloc(ev->target, size);
+    else {
+        // not gcMalloc, it allocates from the innermost arena
+        copy = pointerFree ? GC_malloc_atomic(size) : GC_malloc(size);
+        if (copy == NULL) {
+            printf("AAAA!!! Out of memory allocating %zu bytes\n", size);
+            exit(1);
+        }
+        Lasca_Allocated += size;
+        Lasca_Nr_gcMalloc++;
+    }
+    memcpy(copy, value, size);
+    if (2 * (ev->count + 1) > ev->capacity) {
+        Box** from = ev->from;
+        Box** to = ev->to;
+        size_t capacity = ev->capacity;
+        ev->capacity *= 2;
+        ev->count = 0;
+        ev->from = calloc(ev->capacity, sizeof(Box*));
+        ev->to = calloc(ev->capacity, sizeof(Box*));
+        for (size_t i = 0; i < capacity; i++) {
+            if (from[i] != NULL) evacuationRemember(ev, from[i], to[i]);
+        }
+        free(from);
+        free(to);
+    }
+    evacuationRemember(ev, value, copy);
+    if (!pointerFree) {
+        if (ev->numPending == ev->pendingCapacity) {
+            ev->pendingCapacity *= 2;
+            ev->pending = realloc(ev->pending, ev->pendingCapacity * sizeof(Box*));
+        }
+        ev->pending[ev->numPending++] = copy;
+    }
+    return copy;
+}
+
+static void evacuationCopyFields(Evacuation* ev, Box* copy) {
+    const LaType* type = laTypeOf(copy);
+    switch (type->id) {
+        case LATYPE_ID_ARRAY: {
+            Array* array = asArray(copy);
+            for (int64_t i = 0; i < array->length; i++) array->data[i] = evacuationCopy(ev, array->data[i]);
+            return;
+        }
+        case LATYPE_ID_CLOSURE: {
+            Closure* closure = asClosure(copy);
+            for (int64_t i = 0; i < closure->argc; i++) closure->argv[i] = evacuationCopy(ev, closure->argv[i]);
+            return;
+        }
+        case LATYPE_ID_UNKNOWN: {
+            Unknown* unknown = (Unknown*) copy;
+            unknown->error = (String*) evacuationCopy(ev, (Box*) unknown->error);
+            return;
+        }
+    }
+    DataValue* dataValue = asDataValue(copy);
+    Struct* constr = type->data->constructors[dataValue->header.tag];
+    for (int64_t i = 0; i < constr->numFields; i++) {
+        if (constr->fieldKinds[i] == FIELD_BOXED) dataValue->values[i] = evacuationCopy(ev, dataValue->values[i]);
+    }
+}
+
+// Copies everything value reaches in arenas at least minDepth deep into target
+static Box* arenaEvacuate(Box* value, Arena* target, int64_t minDepth, bool store) {
+    if (arenaDepth(value) < minDepth) return value;
+    Evacuation ev = { .target = target, .minDepth = minDepth, .store = store, .capacity = 64, .pendingCapacity = 64 };
+    ev.from = calloc(ev.capacity, sizeof(Box*));
+    ev.to = calloc(ev.capacity, sizeof(Box*));
+    ev.pending = malloc(ev.pendingCapacity * sizeof(Box*));
+    // iterative, long lists would overflow the stack otherwise
+    Box* result = evacuationCopy(&ev, value);
+    while (ev.numPending > 0) evacuationCopyFields(&ev, ev.pending[--ev.numPending]);
+    free(ev.from);
+    free(ev.to);
+    free(ev.pending);
+    return result;
+}
+
+// value is being stored into obj: copy it into obj's arena or the GC heap if it lives in a deeper arena
+static Box* arenaEscape(void* obj, Box* value) {
+    int64_t depth = arenaDepth(obj);
+    if (arenaDepth(value) <= depth) return value;
+    Arena* target = ARENA;
+    while (target != NULL && target->depth > depth) target = target->parent;
+    return arenaEvacuate(value, target, depth + 1, true);
+}
+
+Box* withArena(Box* f) {
+    Arena* arena = GC_malloc_uncollectable(sizeof(Arena));
+    arena->parent = ARENA;
+    arena->depth = ARENA != NULL ? ARENA->depth + 1 : 1;
+    arena->chunkSize = ARENA_MIN_CHUNK;
+    // with empty free lists inline allocations go to gcMallocRefill, which allocates from the arena
+    memcpy(arena->savedFreeLists, LASCA_FREE_LISTS, sizeof(LASCA_FREE_LISTS));
+    memset(LASCA_FREE_LISTS, 0, sizeof(LASCA_FREE_LISTS));
+    ARENA = arena;
+    LASCA_WRITE_BARRIER = true;
+
+    Box* argv[1] = { (Box*) &UNIT_SINGLETON };
+    Position pos = {0, 0};
+    Box* result = runtimeApply(f, 1, argv, pos);
+    result = arenaEvacuate(result, arena->parent, arena->depth, false);
+
+    ARENA = arena->parent;
+    resetStringCursor();
+    LASCA_WRITE_BARRIER = ARENA != NULL;
+    memcpy(LASCA_FREE_LISTS, arena->savedFreeLists, sizeof(LASCA_FREE_LISTS));
+    for (ArenaChunk* chunk = arena->chunks; chunk != NULL; ) {
+        ArenaChunk* next = chunk->next;
+        GC_free(chunk);
+        chunk = next;
+    }
+    GC_free(arena);
+    return result;
+}
+
 void *gcRealloc(void* old, size_t s) {
     return GC_realloc(old, s);
 }
@@ -119,89 +469,89 @@ const char * __attribute__ ((const)) typeIdToName(const LaType* typeId) {
 
 Box *box(const LaType* type_id, void *value) {
     Box* ti = (Box*) value;
-    ti->type = type_id;
+    ti->header = HEADER(type_id);
     return ti;
 }
 
-Bool* __attribute__ ((pure)) boxBool(int8_t i) {
-    switch (i) {
-        case 0: return &FALSE_SINGLETON; break;
-        default: return &TRUE_SINGLETON; break;
-    }
+Box* __attribute__ ((const)) boxBool(int8_t i) {
+    return makeImmediate(IMMEDIATE_BOOL, i != 0);
 }
 
 Unknown* __attribute__ ((pure)) boxError(String *name) {
     Unknown* value = gcMalloc(sizeof(Unknown));
-    value->type = UNKNOWN;
+    value->header = HEADER(UNKNOWN);
     value->error = name;
     return value;
 }
 
-Byte* __attribute__ ((pure)) boxByte(int8_t i) {
-    return &BYTE_ARRAY[i + 128];
+Box* __attribute__ ((const)) boxByte(int8_t i) {
+    return makeImmediate(IMMEDIATE_BYTE, i);
 }
 
-Int* boxInt(int64_t i) {
-    if (i >= 0 && i < 100) return &INT_ARRAY[i];
-    else {
+Box* boxInt(int64_t i) {
+    if (i >= IMMEDIATE_INT_MIN && i <= IMMEDIATE_INT_MAX) {
+        return (Box*) (((uint64_t) i << 1) | IMMEDIATE_INT_TAG);
+    } else {
         Int* ti = gcMallocAtomic(sizeof(Int));
-        ti->type = LAINT;
+        ti->header = HEADER(LAINT);
         ti->num = i;
-        return ti;
+        return (Box*) ti;
     }
 }
 
-Int16* boxInt16(int16_t i) {
-    Int16* ti = gcMallocAtomic(sizeof(Int16));
-    ti->type = LAINT16;
-    ti->num = i;
-    return ti;
+Box* __attribute__ ((const)) boxInt16(int16_t i) {
+    return makeImmediate(IMMEDIATE_INT16, i);
 }
 
-Int32* boxInt32(int32_t i) {
-    Int32* ti = gcMallocAtomic(sizeof(Int32));
-    ti->type = LAINT32;
-    ti->num = i;
-    return ti;
+Box* __attribute__ ((const)) boxInt32(int32_t i) {
+    return makeImmediate(IMMEDIATE_INT32, i);
 }
 
 Float64* __attribute__ ((pure)) boxFloat64(double i) {
     if (i == 0.0) return &FLOAT64_ZERO;
     Float64* ti = gcMallocAtomic(sizeof(Float64));
-    ti->type = LAFLOAT64;
+    ti->header = HEADER(LAFLOAT64);
     ti->num = i;
     return ti;
 }
 
-Closure* boxClosure(int64_t idx, int64_t argc, Box** args) {
-    Closure* cl = gcMalloc(sizeof(Closure));
-  //  printf("boxClosure(%d, %d, %p)\n", idx, argc, args);
-  //  fflush(stdout);
-    cl->type = LACLOSURE;
+/*
+    Initializes a closure in memory the caller provides: sizeof(Closure) + argc pointers.
+    Used directly for closures that don't escape their function, they live on the stack.
+*/
+Closure* initClosure(Closure* cl, int64_t idx, int64_t argc, Box** args) {
+    Functions* fs = RUNTIME->functions;
+    if (idx >= fs->size) {
+        printf("AAAA!!! No such function with id %"PRId64", max id is %"PRId64"\n", idx, fs->size);
+        exit(1);
+    }
+    Function* f = &fs->functions[idx];
+    cl->header = HEADER(LACLOSURE);
     cl->funcIdx = idx;
+    cl->funcPtr = f->funcPtr;
+    cl->arity = f->arity;
     cl->argc = argc;
-    cl->argv = args;
-  //  printf("Enclose %d, argc = %d, args[0].type = %d, args[1].type = %d\n", idx, argc, args[0]->type, args[1]->type);
-  //  fflush(stdout);
+    memcpy(cl->argv, args, sizeof(Box*) * argc);
     return cl;
 }
 
+Closure* boxClosure(int64_t idx, int64_t argc, Box** args) {
+  //  printf("boxClosure(%d, %d, %p)\n", idx, argc, args);
+  //  fflush(stdout);
+    return initClosure(gcMalloc(sizeof(Closure) + sizeof(Box*) * argc), idx, argc, args);
+}
+
 void * unbox(const LaType* expected, const Box* ti) {
   //  printf("unbox(%d, %d) ", ti->type, (int64_t) ti->value);
-    /* In most cases we can use pointer comparison,
-       but when we use Lasca defined type in C code, we also define a LaType
-       and we need to compare actual qualified type names.
-       TODO/FIXME: think how to make it better, now it's O(typename_length), show be O(1)
-       Likely, not an issue anyway.
-    */
-    if (eqTypes(ti->type, expected)) {
+    const LaType* type = laTypeOf(ti);
+    if (eqTypes(type, expected)) {
         return (void*) ti;
-    } else if (eqTypes(ti->type, UNKNOWN)) {
+    } else if (eqTypes(type, UNKNOWN)) {
         String *name = ((Unknown *) ti)->error;
         printf("AAAA!!! Undefined identifier %s\n", name->bytes);
         exit(1);
     } else {
-        printf("AAAA!!! Expected %s but got %s %p != %p\n", typeIdToName(expected), typeIdToName(ti->type), expected, ti->type);
+        printf("AAAA!!! Expected %s but got %s %p != %p\n", typeIdToName(expected), typeIdToName(type), expected, type);
         exit(1);
     }
 }
@@ -209,34 +559,47 @@ void * unbox(const LaType* expected, const Box* ti) {
 /* ==================== Runtime Ops ============== */
 
 Box* writeVar(DataValue* var, Box* value) {
-    assert(eqTypes(var->type, VAR));
+    assert(var->header.typeId == VAR->id);
     Box* oldValue = var->values[0];
     var->values[0] = value;
+    gcWriteBarrier(var, &var->values[0]);
     return oldValue;
 }
 
-static int64_t isBuiltinType(const Box* v) {
-    const LaType* t = v->type;
-    return eqTypes(t, LAUNIT) || eqTypes(t, LABOOL) || eqTypes(t, LABYTE)
-      || eqTypes(t, LAINT) || eqTypes(t, LAINT16) || eqTypes(t, LAINT32) || eqTypes(t, LAFLOAT64)
-      || eqTypes(t, LASTRING) || eqTypes(t, LACLOSURE) || eqTypes(t, LAARRAY) || eqTypes(t, LABYTEARRAY);
-}
-
 static int64_t isUserType(const Box* v) {
-    return !isBuiltinType(v);
+    return !isImmediate(v) && laTypeOf(v)->kind == LATYPE_KIND_DATA;
 }
 
-#define DO_OP(op) if (eqTypes(lhs->type, LAINT)) { result = (Box*) boxInt(asInt(lhs)->num op asInt(rhs)->num); } \
-                  else if (eqTypes(lhs->type, LABYTE)) { result = (Box*) boxByte(asByte(lhs)->num op asByte(rhs)->num); } \
-                  else if (eqTypes(lhs->type, LAINT32)) { result = (Box*) boxInt32(asInt32(lhs)->num op asInt32(rhs)->num); } \
-                  else if (eqTypes(lhs->type, LAINT16)) { result = (Box*) boxInt16(asInt16(lhs)->num op asInt16(rhs)->num); } \
-                  else if (eqTypes(lhs->type, LAFLOAT64)) { result = (Box*) boxFloat64(asFloat(lhs)->num op asFloat(rhs)->num); } \
-                  else { \
-                        printf("AAAA!!! Type mismatch! Expected Int or Float for op but got %s\n", typeIdToName(lhs->type)); exit(1); }
+#define DO_OP(op) switch (type->id) { \
+                      case LATYPE_ID_INT: result = boxInt(intValue(lhs) op intValue(rhs)); break; \
+                      case LATYPE_ID_BYTE: result = boxByte(byteValue(lhs) op byteValue(rhs)); break; \
+                      case LATYPE_ID_INT32: result = boxInt32(int32Value(lhs) op int32Value(rhs)); break; \
+                      case LATYPE_ID_INT16: result = boxInt16(int16Value(lhs) op int16Value(rhs)); break; \
+                      case LATYPE_ID_FLOAT64: result = (Box*) boxFloat64(asFloat(lhs)->num op asFloat(rhs)->num); break; \
+                      default: \
+                        printf("AAAA!!! Type mismatch! Expected Int or Float for op but got %s\n", typeIdToName(type)); exit(1); }
 
 Box* __attribute__ ((pure)) runtimeBinOp(int64_t code, Box* lhs, Box* rhs) {
-    if (!eqTypes(lhs->type, rhs->type)) {
-        printf("AAAA!!! Type mismatch in binop %"PRId64"! lhs = %s, rhs = %s\n", code, typeIdToName(lhs->type), typeIdToName(rhs->type));
+    const LaType* type = laTypeOf(lhs);
+    // fast path: both operands are immediate Ints
+    if (isImmediateInt(lhs) && isImmediateInt(rhs)) {
+        int64_t l = intValue(lhs);
+        int64_t r = intValue(rhs);
+        switch (code) { // op codes as in lasca.h, they aren't integer constant expressions in C
+            case 10: return boxInt(l + r);   // ADD
+            case 11: return boxInt(l - r);   // SUB
+            case 12: return boxInt(l * r);   // MUL
+            case 13: return boxInt(l / r);   // DIV
+            case 42: return boxBool(l == r); // EQ
+            case 43: return boxBool(l != r); // NE
+            case 44: return boxBool(l < r);  // LT
+            case 45: return boxBool(l <= r); // LE
+            case 46: return boxBool(l >= r); // GE
+            case 47: return boxBool(l > r);  // GT
+        }
+    }
+    if (!eqTypes(type, laTypeOf(rhs))) {
+        printf("AAAA!!! Type mismatch in binop %"PRId64"! lhs = %s, rhs = %s\n", code, typeIdToName(type), typeIdToName(laTypeOf(rhs)));
         exit(1);
     }
 
@@ -251,28 +614,25 @@ Box* __attribute__ ((pure)) runtimeBinOp(int64_t code, Box* lhs, Box* rhs) {
         bool b = (code == EQ && res == 0) || (code == NE && res != 0) ||
                  (code == LT && res == -1) || (code == LE && res != 1) ||
                  (code == GE && res != -1) || (code == GT && res == 1);
-        result = (Box*) boxBool(b);
+        result = boxBool(b);
     }
     return result;
 }
 
 Box* __attribute__ ((pure)) runtimeUnaryOp(int64_t code, Box* expr) {
+    const LaType* type = laTypeOf(expr);
     Box* result = NULL;
     switch (code) {
         case 1:
-            if (eqTypes(expr->type, LAINT)) {
-                result = (Box*) boxInt(-asInt(expr)->num);
-            } else if (eqTypes(expr->type, LABYTE)) {
-                result = (Box*) boxByte(-asByte(expr)->num);
-            } else if (eqTypes(expr->type, LAINT32)) {
-                result = (Box*) boxInt32(-asInt32(expr)->num);
-            } else if (eqTypes(expr->type, LAINT16)) {
-                result = (Box*) boxInt16(-asInt16(expr)->num);
-            } else if (eqTypes(expr->type, LAFLOAT64)) {
-                result = (Box*) boxFloat64(-asFloat(expr)->num);
-            } else {
-                printf("AAAA!!! Type mismatch! Expected Int or Float for op but got %s\n", typeIdToName(expr->type));
-                exit(1);
+            switch (type->id) {
+                case LATYPE_ID_INT: result = boxInt(-intValue(expr)); break;
+                case LATYPE_ID_BYTE: result = boxByte(-byteValue(expr)); break;
+                case LATYPE_ID_INT32: result = boxInt32(-int32Value(expr)); break;
+                case LATYPE_ID_INT16: result = boxInt16(-int16Value(expr)); break;
+                case LATYPE_ID_FLOAT64: result = (Box*) boxFloat64(-asFloat(expr)->num); break;
+                default:
+                    printf("AAAA!!! Type mismatch! Expected Int or Float for op but got %s\n", typeIdToName(type));
+                    exit(1);
             }
             break;
         default:
@@ -287,102 +647,184 @@ String UNIMPLEMENTED_SELECT = {
     .bytes = "Unimplemented select"
 };
 
-Box* runtimeApply(Box* val, int64_t argc, Box* argv[], Position pos) {
-    Functions* fs = RUNTIME->functions;
-    Closure *closure = unbox(LACLOSURE, val);
-    if (closure->funcIdx >= fs->size) {
-        printf("AAAA!!! No such function with id %"PRId64", max id is %"PRId64" at line: %"PRId64"\n", (int64_t) closure->funcIdx, fs->size, pos.line);
-        exit(1);
+/*
+  Calls a Lasca function of known arity. Lasca functions take and return Box*,
+  so for arities up to 8 we cast funcPtr to the exact type and call it directly.
+  Higher arities go through libffi with a prepared cif cached per arity.
+*/
+typedef Box* B;
+
+static ffi_cif** CIF_CACHE = NULL;
+static int64_t CIF_CACHE_SIZE = 0;
+
+static ffi_cif* cifForArity(int64_t arity) {
+    if (arity >= CIF_CACHE_SIZE) {
+        int64_t newSize = arity + 1;
+        CIF_CACHE = realloc(CIF_CACHE, sizeof(ffi_cif*) * newSize);
+        memset(CIF_CACHE + CIF_CACHE_SIZE, 0, sizeof(ffi_cif*) * (newSize - CIF_CACHE_SIZE));
+        CIF_CACHE_SIZE = newSize;
     }
-    Function f = fs->functions[closure->funcIdx];
-    if (f.arity != argc + closure->argc) {
-        printf("AAAA!!! Function %s takes %"PRId64" params, but passed %"PRId64" enclosed params and %"PRId64" params instead at line: %"PRId64"\n",
-            f.name->bytes, f.arity, closure->argc, argc, pos.line);
-        exit(1);
+    if (CIF_CACHE[arity] == NULL) {
+        ffi_cif* cif = malloc(sizeof(ffi_cif));
+        ffi_type** args = malloc(sizeof(ffi_type*) * arity);
+        for (int64_t i = 0; i < arity; i++) args[i] = &ffi_type_pointer;
+        if (ffi_prep_cif(cif, FFI_DEFAULT_ABI, arity, &ffi_type_pointer, args) != FFI_OK) {
+            printf("AAAA!!! ffi_prep_cif call failed for arity %"PRId64"\n", arity);
+            exit(1);
+        }
+        CIF_CACHE[arity] = cif;
     }
+    return CIF_CACHE[arity];
+}
 
-    ffi_cif cif;
-    ffi_type *args[f.arity];
-    void *values[f.arity];
-    Box* rc;
-
-    for (int i = 0; i < f.arity; i++) {
-        args[i] = &ffi_type_pointer;
-        values[i] = (i < closure->argc) ? &closure->argv[i] : &argv[i - closure->argc];
+static inline Box* callFunction(void* funcPtr, int64_t arity, Box** a) {
+    switch (arity) {
+        case 0: return ((B (*)()) funcPtr)();
+        case 1: return ((B (*)(B)) funcPtr)(a[0]);
+        case 2: return ((B (*)(B, B)) funcPtr)(a[0], a[1]);
+        case 3: return ((B (*)(B, B, B)) funcPtr)(a[0], a[1], a[2]);
+        case 4: return ((B (*)(B, B, B, B)) funcPtr)(a[0], a[1], a[2], a[3]);
+        case 5: return ((B (*)(B, B, B, B, B)) funcPtr)(a[0], a[1], a[2], a[3], a[4]);
+        case 6: return ((B (*)(B, B, B, B, B, B)) funcPtr)(a[0], a[1], a[2], a[3], a[4], a[5]);
+        case 7: return ((B (*)(B, B, B, B, B, B, B)) funcPtr)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        case 8: return ((B (*)(B, B, B, B, B, B, B, B)) funcPtr)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+        default: {
+            void *values[arity];
+            Box* rc;
+            for (int64_t i = 0; i < arity; i++) values[i] = &a[i];
+            ffi_call(cifForArity(arity), funcPtr, &rc, values);
+            return rc;
+        }
     }
-    if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, f.arity, &ffi_type_pointer, args) != FFI_OK) {
-    		printf("AAAA!!! Function %s ffi_prep_cif call failed\n", f.name->bytes);
+}
+
+static void checkClosureArity(Closure* closure, int64_t argc, Position pos) {
+    if (closure->arity != argc + closure->argc) {
+        Function* f = &RUNTIME->functions->functions[closure->funcIdx];
+        printf("AAAA!!! Function %s takes %"PRId64" params, but passed %"PRId64" enclosed params and %"PRId64" params instead at line: %"PRId64"\n",
+            f->name->bytes, closure->arity, closure->argc, argc, pos.line);
         exit(1);
     }
-    ffi_call(&cif, f.funcPtr, &rc, values);
-    return rc;
+}
+
+static inline Box* applyClosure(Closure* closure, int64_t argc, Box* argv[]) {
+    if (closure->argc == 0) return callFunction(closure->funcPtr, argc, argv);
+
+    // enclosed params go first
+    Box* args[closure->arity];
+    memcpy(args, closure->argv, sizeof(Box*) * closure->argc);
+    memcpy(args + closure->argc, argv, sizeof(Box*) * argc);
+    return callFunction(closure->funcPtr, closure->arity, args);
+}
+
+Box* runtimeApply(Box* val, int64_t argc, Box* argv[], Position pos) {
+    Closure *closure = unbox(LACLOSURE, val);
+    checkClosureArity(closure, argc, pos);
+    return applyClosure(closure, argc, argv);
 }
 
 Data* findDataType(const LaType* type) {
-    Types* types = RUNTIME->types;
-    for (int i = 0; i < types->size; i++) {
-        if (eqTypes(types->data[i]->type, type)) return types->data[i];
-    }
+    if (type->data != NULL) return type->data;
     printf("AAAA! Couldn't find type %s", type->name);
     exit(1);
 }
 
-Box* __attribute__ ((pure)) runtimeSelect(Box* tree, Box* ident, Position pos) {
-    Functions* fs = RUNTIME->functions;
+// Field i of a data value, raw scalar fields are boxed
+Box* dataValueField(const DataValue* value, const Struct* constr, int64_t i) {
+    void* slot = (void*) &value->values[i];
+    switch (constr->fieldKinds[i]) {
+      case FIELD_INT: return boxInt(*(int64_t*) slot);
+      case FIELD_FLOAT: return (Box*) boxFloat64(*(double*) slot);
+      case FIELD_BOOL: return boxBool(*(int8_t*) slot);
+      case FIELD_BYTE: return boxByte(*(int8_t*) slot);
+      default: return value->values[i];
+    }
+}
 
+Box* __attribute__ ((pure)) runtimeSelect(Box* tree, Box* ident, Position pos) {
 //    printf("isUserType %s %p %p\n", tree->type->name, tree->type, &Unknown_LaType);
     if (isUserType(tree)) {
 
         DataValue* dataValue = asDataValue(tree);
         // if rhs is not a local ident, nor a function, try to find this field in lhs data structure
-        if (eqTypes(ident->type, UNKNOWN)) {
+        if (eqTypes(laTypeOf(ident), UNKNOWN)) {
             String* name = ((Unknown*)ident)->error; // should be identifier name
 //            printf("Ident name %s\n", name->bytes);
-            Data* data = findDataType(tree->type); // find struct in global array of structs
+            Data* data = findDataType(laTypeOf(tree));
 //            printf("Found data type %s %s, tag %"PRId64"\n", data->name->bytes, tree->type->name, dataValue->tag);
-            Struct* constr = data->constructors[dataValue->tag];
+            Struct* constr = data->constructors[dataValue->header.tag];
             int64_t numFields = constr->numFields;
             for (int64_t i = 0; i < numFields; i++) {
                 String* field = constr->fields[i];
         //        printf("Check field %d %s\n", field->length, field->bytes);
                 if (field->length == name->length && strncmp(field->bytes, name->bytes, name->length) == 0) {
-                    Box* value = dataValue->values[i];
+                    Box* value = dataValueField(dataValue, constr, i);
 //                    printf("Found value %s at index %"PRId64"\n", value->type->name, i);
           //          println(toString(value));
                     return value;
                 }
             }
             printf("Couldn't find field %s at line: %"PRId64"\n", name->bytes, pos.line);
-        } else if (eqTypes(ident->type, LACLOSURE)) {
+        } else if (eqTypes(laTypeOf(ident), LACLOSURE)) {
               // FIXME fix for closure?  check arity?
-              Closure* f = asClosure(ident);
-              assert(fs->functions[f->funcIdx].arity == 1);
+              assert(asClosure(ident)->arity == 1);
               return runtimeApply(ident, 1, &tree, pos);
         }
-    } else if (eqTypes(ident->type, LACLOSURE)) {
+    } else if (eqTypes(laTypeOf(ident), LACLOSURE)) {
         // FIXME fix for closure?  check arity?
-        Closure* f = asClosure(ident);
-        assert(fs->functions[f->funcIdx].arity == 1);
+        assert(asClosure(ident)->arity == 1);
         return runtimeApply(ident, 1, &tree, pos);
     }
     return (Box*) boxError(&UNIMPLEMENTED_SELECT);
 }
 
+/*
+  Slow path of a field select site inline cache, see cgenSelectField in EmitDynamic.hs.
+  Finds the field by its symbol id and remembers its slot for the value's type and tag.
+*/
+Box* runtimeSelectField(SelectCacheEntry* cache, Box* tree, int64_t fieldId, String* name, Position pos) {
+    if (isUserType(tree)) {
+        DataValue* dataValue = asDataValue(tree);
+        Struct* constr = findDataType(laTypeOf(tree))->constructors[dataValue->header.tag];
+        for (int64_t i = 0; i < constr->numFields; i++) {
+            if (constr->fieldIds[i] == fieldId) {
+                // the inline cache loads the slot as Box*, so it only remembers boxed fields
+                if (constr->fieldKinds[i] == FIELD_BOXED) {
+                    cache->header = dataValue->header;
+                    cache->slot = i;
+                }
+                return dataValueField(dataValue, constr, i);
+            }
+        }
+        printf("Couldn't find field %s at line: %"PRId64"\n", name->bytes, pos.line);
+    }
+    return (Box*) boxError(&UNIMPLEMENTED_SELECT);
+}
+
 int8_t runtimeIsConstr(Box* value, Box* constrName) {
     if (isUserType(value)) {
         String* name = unbox(LASTRING, constrName);
-        Data* data = findDataType(value->type);
+        Data* data = findDataType(laTypeOf(value));
         DataValue* dv = asDataValue(value);
-        String* realConstrName = data->constructors[dv->tag]->name;
-        if (strncmp(realConstrName->bytes, name->bytes, fmin(realConstrName->length, name->length)) == 0)
-            return true;
+        String* realConstrName = data->constructors[dv->header.tag]->name;
+        return realConstrName->length == name->length && memcmp(realConstrName->bytes, name->bytes, name->length) == 0;
     }
     return false;
 }
 
 int8_t runtimeCheckTag(Box* value, int64_t tag) {
     DataValue* dv = asDataValue(value);
-    return dv->tag == tag;
+    return dv->header.tag == tag;
+}
+
+// Constructor check when the value type is unknown, e.g. in dynamic mode. Type id and tag are known at compile time.
+int8_t runtimeCheckConstr(Box* value, int64_t typeId, int64_t tag) {
+    return !isImmediate(value) && value->header.typeId == typeId && value->header.tag == tag;
+}
+
+// Constructor tag of a data value of type typeId, or -1 for any other value. Used for match switches.
+int64_t runtimeDataTag(Box* value, int64_t typeId) {
+    return !isImmediate(value) && value->header.typeId == typeId ? value->header.tag : -1;
 }
 
 /* =================== Arrays ================= */
@@ -390,8 +832,25 @@ int8_t runtimeCheckTag(Box* value, int64_t tag) {
 
 Array* createArray(size_t size) {
     Array * array = gcMalloc(sizeof(Array) + sizeof(Box*) * size);
-    array->type = LAARRAY;
+    array->header = HEADER(LAARRAY);
+    array->length = size;
+    return array;
+}
+
+// GC_malloc_atomic doesn't clear memory, so raw arrays are zeroed explicitly
+IntArray* createIntArray(size_t size) {
+    IntArray* array = gcMallocAtomic(sizeof(IntArray) + sizeof(int64_t) * size);
+    array->header = HEADER(LAINTARRAY);
+    array->length = size;
+    memset(array->data, 0, sizeof(int64_t) * size);
+    return array;
+}
+
+FloatArray* createFloatArray(size_t size) {
+    FloatArray* array = gcMallocAtomic(sizeof(FloatArray) + sizeof(double) * size);
+    array->header = HEADER(LAFLOATARRAY);
     array->length = size;
+    memset(array->data, 0, sizeof(double) * size);
     return array;
 }
 
@@ -409,10 +868,8 @@ Box* boxArray(size_t size, ...) {
 
 String* __attribute__ ((pure)) makeString(const char * str) {
     size_t len = strlen(str);
-    String* val = gcMalloc(sizeof(String) + len + 1);  // null terminated
-    val->type = LASTRING;
-    val->length = len;
-    strncpy(val->bytes, str, len);
+    String* val = gcMallocString(LASTRING, len);
+    memcpy(val->bytes, str, len);
     return val;
 }
 
@@ -443,16 +900,22 @@ String* joinValues(int size, Box* values[], char* start, char* end) {
 }
 
 String* __attribute__ ((pure)) arrayToString(const Box* arrayValue)  {
-    Array* array = unbox(LAARRAY, arrayValue);
-    if (array->length == 0) {
+    int64_t length = arrayLength((Box*) arrayValue);
+    if (length == 0) {
         return makeString("[]");
+    } else if (eqTypes(laTypeOf(arrayValue), LAARRAY)) {
+        return joinValues(length, asArray(arrayValue)->data, "[", "]");
     } else {
-        return joinValues(array->length, array->data, "[", "]");
+        Box** values = gcMalloc(sizeof(Box*) * length);
+        for (int64_t i = 0; i < length; i++) {
+            values[i] = arrayGetIndex((Box*) arrayValue, i);
+        }
+        return joinValues(length, values, "[", "]");
     }
 }
 
 String* typeOf(Box* value) {
-    return makeString(value->type->name);
+    return makeString(laTypeOf(value)->name);
 }
 
 String* __attribute__ ((pure)) byteArrayToString(const Box* arrayValue)  {
@@ -461,8 +924,7 @@ String* __attribute__ ((pure)) byteArrayToString(const Box* arrayValue)  {
         return makeString("[]");
     } else {
         int len = 6 * array->length + 2 + 1; // max (4 + 2 (separator)) symbols per byte + [] + 0
-        String* res = gcMalloc(sizeof(String) + len);
-        res->type = LASTRING;
+        String* res = gcMallocString(LASTRING, len);
         strcpy(res->bytes, "[");
         char buf[7];
         int curPos = 1;
@@ -494,55 +956,65 @@ String* __attribute__ ((pure)) toString(const Box* value) {
 
     if (value == NULL) return makeString("<NULL>");
 
-    const LaType* type = value->type;
-    if (eqTypes(type, LAUNIT)) {
+    const LaType* type = laTypeOf(value);
+    switch (type->id) {
+      case LATYPE_ID_UNIT:
         return UNIT_STRING;
-    } else if (eqTypes(type, LABOOL)) {
-        return makeString(asBool(value)->num == 0 ? "false" : "true");
-    } else if (eqTypes(type, LAINT)) {
-        snprintf(buf, 100, "%"PRId64, asInt(value)->num);
+      case LATYPE_ID_BOOL:
+        return makeString(boolValue(value) == 0 ? "false" : "true");
+      case LATYPE_ID_INT:
+        snprintf(buf, 100, "%"PRId64, intValue(value));
         return makeString(buf);
-    } else if (eqTypes(type, LAINT16)) {
-        snprintf(buf, 100, "%"PRId16, asInt16(value)->num);
+      case LATYPE_ID_INT16:
+        snprintf(buf, 100, "%"PRId16, int16Value(value));
         return makeString(buf);
-    } else if (eqTypes(type, LAINT32)) {
-        snprintf(buf, 100, "%"PRId32, asInt32(value)->num);
+      case LATYPE_ID_INT32:
+        snprintf(buf, 100, "%"PRId32, int32Value(value));
         return makeString(buf);
-    } else if (eqTypes(type, LABYTE)) {
-        snprintf(buf, 100, "%"PRId8, asByte(value)->num);
+      case LATYPE_ID_BYTE:
+        snprintf(buf, 100, "%"PRId8, byteValue(value));
         return makeString(buf);
-    } else if (eqTypes(type, LAFLOAT64)) {
+      case LATYPE_ID_FLOAT64:
         snprintf(buf, 100, "%12.9lf", asFloat(value)->num);
         return makeString(buf);
-    } else if (eqTypes(type, LASTRING)) {
+      case LATYPE_ID_STRING:
         return asString(value);
-    } else if (eqTypes(type, LACLOSURE)) {
+      case LATYPE_ID_CLOSURE:
         return makeString("<func>");
-    } else if (eqTypes(type, LAARRAY)) {
+      case LATYPE_ID_ARRAY:
+      case LATYPE_ID_INTARRAY:
+      case LATYPE_ID_FLOATARRAY:
         return arrayToString(value);
-    } else if (eqTypes(type, LABYTEARRAY)) {
+      case LATYPE_ID_BYTEARRAY:
         return byteArrayToString(value);
-    } else if (eqTypes(type, VAR)) {
-        DataValue* dataValue = asDataValue(value);
-        return toString(dataValue->values[0]);
-    } else if (eqTypes(type, UNKNOWN)) {
+      case LATYPE_ID_SYMBOL:
+        return asSymbol(value)->name;
+      case LATYPE_ID_UNKNOWN: {
         String *name = ((Unknown *) value)->error;
         printf("AAAA!!! Undefined identifier in toString %s\n", name->bytes);
         exit(1);
-    } else {
-        if (isUserType(value)) {
+      }
+      default:
+        if (eqTypes(type, VAR)) {
+            DataValue* dataValue = asDataValue(value);
+            return toString(dataValue->values[0]);
+        } else if (isUserType(value)) {
             DataValue* dataValue = asDataValue(value);
             Data* metaData = findDataType(type);
-            Struct* constr = metaData->constructors[dataValue->tag];
+            Struct* constr = metaData->constructors[dataValue->header.tag];
             int64_t startlen = constr->name->length + 2; // ending 0 and possibly "(" if constructor has parameters
             char start[startlen];
             snprintf(start, startlen, "%s", constr->name->bytes);
             if (constr->numFields > 0) {
                 strcat(start, "(");
-                return joinValues(constr->numFields, dataValue->values, start, ")");
+                Box* values[constr->numFields];
+                for (int64_t i = 0; i < constr->numFields; i++) {
+                    values[i] = dataValueField(dataValue, constr, i);
+                }
+                return joinValues(constr->numFields, values, start, ")");
             } else return makeString(start);
         } else {
-            printf("Unsupported type %s", typeIdToName(value->type));
+            printf("Unsupported type %s", typeIdToName(type));
             exit(1);
         }
     }
@@ -557,14 +1029,12 @@ String* concat(Box* arrayString) {
             String* s = unbox(LASTRING, array->data[i]);
             len += s->length;
         }
-        String* val = gcMalloc(sizeof(String) + len + 1); // +1 for null-termination
-        val->type = LASTRING;
-        // val->length is 0, because gcMalloc allocates zero-initialized memory
-        // it's also zero terminated, because gcMalloc allocates zero-initialized memory
+        String* val = gcMallocString(LASTRING, len);
+        int64_t offset = 0;
         for (int64_t i = 0; i < array->length; i++) {
             String* s = unbox(LASTRING, array->data[i]);
-            memcpy(&val->bytes[val->length], s->bytes, s->length);
-            val->length += s->length;
+            memcpy(&val->bytes[offset], s->bytes, s->length);
+            offset += s->length;
         }
         result = val;
     }
@@ -580,65 +1050,175 @@ unsigned long long xxHashSeed = 0;
 XXH_errorcode lascaGetHashable(Box* value, XXH64_state_t* const state) {
     if (value == NULL) return XXH64_update(state, NULL, 0);
 
-    const LaType* type = value->type;
-    if (eqTypes(type, LAUNIT)) {
+    const LaType* type = laTypeOf(value);
+    switch (type->id) {
+      case LATYPE_ID_UNIT:
         return XXH64_update(state, &UNIT_SINGLETON, sizeof(UNIT_SINGLETON));
-    } else if (eqTypes(type, LABOOL)) {
-        return XXH64_update(state, (char*) &asBool(value)->num, sizeof(asBool(value)->num));
-    } else if (eqTypes(type, LAINT)) {
-        return XXH64_update(state, (char*) &asInt(value)->num, sizeof(asInt(value)->num));
-    } else if (eqTypes(type, LAINT16)) {
-        return XXH64_update(state, (char*) &asInt16(value)->num, sizeof(asInt16(value)->num));
-    } else if (eqTypes(type, LAINT32)) {
-        return XXH64_update(state, (char*) &asInt32(value)->num, sizeof(asInt32(value)->num));
-    } else if (eqTypes(type, LABYTE)) {
-        return XXH64_update(state, (char*) &asByte(value)->num, sizeof(asByte(value)->num));
-    } else if (eqTypes(type, LAFLOAT64)) {
+      case LATYPE_ID_BOOL: {
+        int8_t b = boolValue(value);
+        return XXH64_update(state, (char*) &b, sizeof(b));
+      }
+      case LATYPE_ID_INT: {
+        int64_t i = intValue(value);
+        return XXH64_update(state, (char*) &i, sizeof(i));
+      }
+      case LATYPE_ID_INT16: {
+        int16_t i = int16Value(value);
+        return XXH64_update(state, (char*) &i, sizeof(i));
+      }
+      case LATYPE_ID_INT32: {
+        int32_t i = int32Value(value);
+        return XXH64_update(state, (char*) &i, sizeof(i));
+      }
+      case LATYPE_ID_BYTE: {
+        int8_t b = byteValue(value);
+        return XXH64_update(state, (char*) &b, sizeof(b));
+      }
+      case LATYPE_ID_FLOAT64:
         return XXH64_update(state, (char*) &asFloat(value)->num, sizeof(asFloat(value)->num));
-    } else if (eqTypes(type, LASTRING)) {
+      case LATYPE_ID_STRING: {
         String* s = asString(value);
         return XXH64_update(state, s->bytes, s->length);
-    } else if (eqTypes(type, LACLOSURE)) {
-        return XXH64_update(state, (char*) &value, sizeof(Closure));
-    } else if (eqTypes(type, LAARRAY)) {
+      }
+      case LATYPE_ID_CLOSURE:
+        return XXH64_update(state, (char*) &value, sizeof(value));
+      case LATYPE_ID_ARRAY: {
         Array* array = asArray(value);
         for (size_t i = 0; i < array->length; i++) {
             lascaGetHashable(array->data[i], state);
         }
         return XXH_OK;
-    } else if (eqTypes(type, LABYTEARRAY)) {
+      }
+      // same hash as the boxed Array of the same Ints/Floats, element bytes are hashed in order
+      case LATYPE_ID_INTARRAY: {
+        IntArray* array = asIntArray(value);
+        return XXH64_update(state, (char*) array->data, sizeof(int64_t) * array->length);
+      }
+      case LATYPE_ID_FLOATARRAY: {
+        FloatArray* array = asFloatArray(value);
+        return XXH64_update(state, (char*) array->data, sizeof(double) * array->length);
+      }
+      case LATYPE_ID_BYTEARRAY: {
         String* s = asString(value);
         return XXH64_update(state, s->bytes, s->length);
-    } else if (eqTypes(type, VAR)) {
-        DataValue* dataValue = asDataValue(value);
-        return lascaGetHashable(dataValue->values[0], state);
-    } else if (eqTypes(type, UNKNOWN)) {
+      }
+      case LATYPE_ID_SYMBOL:
+        return XXH64_update(state, (char*) &asSymbol(value)->hash, sizeof(int64_t));
+      case LATYPE_ID_UNKNOWN: {
         String *name = ((Unknown *) value)->error;
         printf("AAAA!!! Undefined identifier in toString %s\n", name->bytes);
         exit(1);
-    } else {
-        if (isUserType(value)) {
+      }
+      default:
+        if (eqTypes(type, VAR)) {
+            DataValue* dataValue = asDataValue(value);
+            return lascaGetHashable(dataValue->values[0], state);
+        } else if (isUserType(value)) {
             DataValue* dataValue = asDataValue(value);
             Data* metaData = findDataType(type);
-            Struct* constr = metaData->constructors[dataValue->tag];
+            Struct* constr = metaData->constructors[dataValue->header.tag];
             for (size_t i = 0; i < constr->numFields; i++) {
-                lascaGetHashable(dataValue->values[i], state);
+                lascaGetHashable(dataValueField(dataValue, constr, i), state);
             }
             return XXH_OK;
         } else {
-            printf("Unsupported type %s", typeIdToName(value->type));
+            printf("Unsupported type %s", typeIdToName(type));
             exit(1);
         }
     }
 }
 
 int64_t lascaHashCode(Box* value) {
+    if (value != NULL && !isImmediate(value) && value->header.typeId == LATYPE_ID_SYMBOL) return asSymbol(value)->hash;
     XXH64_state_t* const state = XXH64_createState();
     XXH_errorcode const resetResult = XXH64_reset(state, xxHashSeed);
     lascaGetHashable(value, state);
     return (int64_t) XXH64_digest(state);
 }
 
+/* ============ Symbols ================ */
+
+/*
+    Intern table: open addressing by name hash, grown at half load.
+    The runtime is single threaded, the table is a plain global like the free lists.
+    Symbols are never freed: the table is uncollectable, and symbols are never allocated in an arena.
+*/
+static Symbol** SYMBOL_TABLE = NULL;
+static int64_t SYMBOL_TABLE_CAPACITY = 0;
+static int64_t SYMBOLS_COUNT = 0; // also the id of the next symbol
+
+// same as lascaHashCode of the name String
+static int64_t symbolHash(const char* bytes, int64_t length) {
+    return (int64_t) XXH64(bytes, length, xxHashSeed);
+}
+
+static void symbolTableInsert(Symbol* symbol) {
+    int64_t mask = SYMBOL_TABLE_CAPACITY - 1;
+    int64_t i = symbol->hash & mask;
+    while (SYMBOL_TABLE[i] != NULL) i = (i + 1) & mask;
+    SYMBOL_TABLE[i] = symbol;
+}
+
+static void symbolTableAdd(Symbol* symbol) {
+    if (2 * (SYMBOLS_COUNT + 1) > SYMBOL_TABLE_CAPACITY) {
+        Symbol** old = SYMBOL_TABLE;
+        int64_t oldCapacity = SYMBOL_TABLE_CAPACITY;
+        SYMBOL_TABLE_CAPACITY = oldCapacity == 0 ? 256 : 2 * oldCapacity;
+        SYMBOL_TABLE = GC_malloc_uncollectable(sizeof(Symbol*) * SYMBOL_TABLE_CAPACITY);
+        for (int64_t i = 0; i < oldCapacity; i++) {
+            if (old[i] != NULL) symbolTableInsert(old[i]);
+        }
+        if (old != NULL) GC_free(old);
+    }
+    symbolTableInsert(symbol);
+    SYMBOLS_COUNT++;
+}
+
+static void initSymbols(Symbols* symbols) {
+    for (int64_t i = 0; i < symbols->size; i++) {
+        Symbol* symbol = symbols->symbols[i];
+        if (symbol->id != i) {
+            printf("AAAA!!! Symbol %s has id %"PRId64", expected %"PRId64"\n", symbol->name->bytes, symbol->id, i);
+            exit(1);
+        }
+        symbol->hash = symbolHash(symbol->name->bytes, symbol->name->length);
+        symbolTableAdd(symbol);
+    }
+}
+
+Symbol* intern(const char* bytes, int64_t length) {
+    int64_t hash = symbolHash(bytes, length);
+    int64_t mask = SYMBOL_TABLE_CAPACITY - 1;
+    for (int64_t i = hash & mask; SYMBOL_TABLE != NULL && SYMBOL_TABLE[i] != NULL; i = (i + 1) & mask) {
+        Symbol* symbol = SYMBOL_TABLE[i];
+        if (symbol->hash == hash && symbol->name->length == length && memcmp(symbol->name->bytes, bytes, length) == 0) {
+            return symbol;
+        }
+    }
+    // not gcMalloc: symbols outlive arenas
+    String* name = GC_malloc_atomic(sizeof(String) + length + 1);
+    name->header = HEADER(LASTRING);
+    name->length = length;
+    memcpy(name->bytes, bytes, length);
+    name->bytes[length] = 0;
+    Symbol* symbol = GC_malloc(sizeof(Symbol));
+    symbol->header = HEADER(LASYMBOL);
+    symbol->hash = hash;
+    symbol->id = SYMBOLS_COUNT;
+    symbol->name = name;
+    symbolTableAdd(symbol);
+    return symbol;
+}
+
+Box* internString(Box* string) {
+    String* s = unbox(LASTRING, string);
+    return (Box*) intern(s->bytes, s->length);
+}
+
+Box* symbolName(Box* symbol) {
+    return (Box*) ((Symbol*) unbox(LASYMBOL, symbol))->name;
+}
+
 /* ============ System ================ */
 
 void initEnvironment(int64_t argc, char* argv[]) {
@@ -724,29 +1304,192 @@ void onexit() {
     printf("\tAverage alloc: %"PRIu64" bytes\n", Lasca_Allocated / Lasca_Nr_gcMalloc);
 }
 
-void initLascaRuntime(Runtime* runtime) {
+const LaType** TYPE_REGISTRY;
+static int32_t TYPE_REGISTRY_SIZE;
+
+const LaType* typeById(int32_t id) {
+    if (id < 0 || id >= TYPE_REGISTRY_SIZE) {
+        printf("AAAA!!! No type with id %"PRId32"\n", id);
+        exit(1);
+    }
+    return TYPE_REGISTRY[id];
+}
+
+static void initTypeRegistry(Types* types) {
+    const LaType* builtinTypes[] = {
+        &Unknown_LaType, &Unit_LaType, &Bool_LaType, &Byte_LaType, &Int16_LaType, &Int32_LaType,
+        &Int_LaType, &Float_LaType, &String_LaType, &Closure_LaType, &Array_LaType, &ByteArray_LaType,
+        &IntArray_LaType, &FloatArray_LaType, &Symbol_LaType,
+        &_VAR, &_OPTION, &_PATTERN, &_FILE_HANDLE
+    };
+    LaType* cTypes[] = { &_VAR, &_OPTION, &_PATTERN, &_FILE_HANDLE };
+    TYPE_REGISTRY_SIZE = FIRST_DATA_TYPE_ID + types->size;
+    TYPE_REGISTRY = GC_malloc_uncollectable(sizeof(LaType*) * TYPE_REGISTRY_SIZE);
+    for (int32_t i = 0; i < FIRST_DATA_TYPE_ID; i++) {
+        assert(builtinTypes[i]->id == i);
+        TYPE_REGISTRY[i] = builtinTypes[i];
+    }
+    for (int32_t i = 0; i < types->size; i++) {
+        LaType* type = types->data[i]->type;
+        if (type->id != FIRST_DATA_TYPE_ID + i) {
+            printf("AAAA!!! Type %s has id %"PRId32", expected %"PRId32"\n", type->name, type->id, FIRST_DATA_TYPE_ID + i);
+            exit(1);
+        }
+        if (type->data != types->data[i]) {
+            printf("AAAA!!! Type %s has wrong data descriptor\n", type->name);
+            exit(1);
+        }
+        TYPE_REGISTRY[type->id] = type;
+        // the only place where we compare type names: give C side types ids of compiled data types
+        for (int j = 0; j < sizeof(cTypes) / sizeof(cTypes[0]); j++) {
+            if (strcmp(cTypes[j]->name, type->name) == 0) {
+                cTypes[j]->id = type->id;
+                cTypes[j]->data = type->data;
+            }
+        }
+    }
+}
+
+/*
+    RTS options, in the spirit of GHC's +RTS ... -RTS.
+    They are read from the LASCA_RTS environment variable first, then from +RTS ... -RTS sections
+    of the command line, so the command line wins. Keep RTS_HELP in sync.
+*/
+typedef struct {
+    size_t initialHeap;
+    size_t maxHeap;           // 0 means unlimited
+    int64_t freeSpaceDivisor; // 0 means the collector default
+    int64_t markers;          // 0 means the collector default
+    bool incremental;
+    bool stats;
+} RtsOptions;
+
+static RtsOptions RTS_OPTIONS = { .initialHeap = 4*1024*1024 };
+
+static const char* RTS_HELP =
+    "Lasca RTS options, in LASCA_RTS or between +RTS and -RTS on the command line:\n"
+    "  -H<size>     initial heap size, e.g. -H64m (default 4m)\n"
+    "  -M<size>     maximum heap size (default unlimited)\n"
+    "  -F<n>        free space divisor: larger values give smaller heaps and more frequent collections\n"
+    "  -N<n>        number of parallel marker threads\n"
+    "  -G           enable libgc incremental marking\n"
+    "  -S           print GC statistics on exit\n"
+    "  --rts-help   print this help\n"
+    "Sizes take an optional k, m or g suffix.\n";
+
+static size_t parseRtsNumber(const char* option, const char* value, bool allowSuffix) {
+    // strtoull would skip spaces and wrap a minus sign around, only take plain digits
+    if (*value < '0' || *value > '9') {
+        printf("AAAA!!! RTS option %s expects a number\n", option);
+        exit(1);
+    }
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    unsigned long long multiplier = 1;
+    if (allowSuffix) {
+        switch (*end) {
+            case 'k': case 'K': multiplier = 1024; end++; break;
+            case 'm': case 'M': multiplier = 1024 * 1024; end++; break;
+            case 'g': case 'G': multiplier = 1024 * 1024 * 1024; end++; break;
+        }
+    }
+    if (*end != 0) {
+        printf("AAAA!!! Invalid RTS option %s\n", option);
+        exit(1);
+    }
+    if (errno == ERANGE || n > SIZE_MAX / multiplier) {
+        printf("AAAA!!! RTS option %s is too large, the maximum is %zu\n", option, (size_t) SIZE_MAX);
+        exit(1);
+    }
+    return n * multiplier;
+}
+
+static void parseRtsOption(const char* option) {
+    if (strcmp(option, "--rts-help") == 0) {
+        printf("%s", RTS_HELP);
+        exit(0);
+    }
+    const char* value = option + 2;
+    if (option[0] == '-' && option[1] != 0) {
+        switch (option[1]) {
+            case 'H': RTS_OPTIONS.initialHeap = parseRtsNumber(option, value, true); return;
+            case 'M': RTS_OPTIONS.maxHeap = parseRtsNumber(option, value, true); return;
+            case 'F': RTS_OPTIONS.freeSpaceDivisor = parseRtsNumber(option, value, false); return;
+            case 'N': RTS_OPTIONS.markers = parseRtsNumber(option, value, false); return;
+            case 'G': if (*value == 0) { RTS_OPTIONS.incremental = true; return; } break;
+            case 'S': if (*value == 0) { RTS_OPTIONS.stats = true; return; } break;
+        }
+    }
+    printf("AAAA!!! Unknown RTS option %s, try --rts-help\n", option);
+    exit(1);
+}
+
+/*
+    Parses RTS options and removes them from argv in place.
+    Returns the number of remaining arguments, argv[0] included.
+*/
+static int64_t parseRtsOptions(int64_t argc, char* argv[]) {
+    const char* env = getenv("LASCA_RTS");
+    if (env != NULL) {
+        char* options = strdup(env);
+        for (char* option = strtok(options, " \t"); option != NULL; option = strtok(NULL, " \t")) {
+            parseRtsOption(option);
+        }
+        free(options);
+    }
+    int64_t n = 0;
+    bool inRts = false;
+    for (int64_t i = 0; i < argc; i++) {
+        if (i == 0) argv[n++] = argv[i];
+        else if (!inRts && strcmp(argv[i], "+RTS") == 0) inRts = true;
+        else if (inRts && strcmp(argv[i], "-RTS") == 0) inRts = false;
+        else if (inRts) parseRtsOption(argv[i]);
+        else argv[n++] = argv[i];
+    }
+    if (RTS_OPTIONS.maxHeap > 0 && RTS_OPTIONS.maxHeap < RTS_OPTIONS.initialHeap) {
+        printf("AAAA!!! RTS option -M%zu is smaller than the initial heap size %zu, see -H\n",
+            RTS_OPTIONS.maxHeap, RTS_OPTIONS.initialHeap);
+        exit(1);
+    }
+    return n;
+}
+
+int64_t initLascaRuntime(Runtime* runtime, int64_t argc, char* argv[]) {
+    argc = parseRtsOptions(argc, argv);
+    // the number of marker threads is fixed when the collector starts
+    if (RTS_OPTIONS.markers > 0) {
+#if GC_VERSION_MAJOR > 8 || (GC_VERSION_MAJOR == 8 && GC_VERSION_MINOR >= 2)
+        GC_set_markers_count((unsigned) RTS_OPTIONS.markers);
+#else
+        // older collectors only read it from the environment
+        char markers[32];
+        snprintf(markers, sizeof(markers), "%"PRId64, RTS_OPTIONS.markers);
+        setenv("GC_MARKERS", markers, 1);
+#endif
+    }
     GC_init();
-    GC_expand_hp(4*1024*1024);
+    GC_expand_hp(RTS_OPTIONS.initialHeap);
+    if (RTS_OPTIONS.maxHeap > 0) GC_set_max_heap_size(RTS_OPTIONS.maxHeap);
+    if (RTS_OPTIONS.freeSpaceDivisor > 0) GC_set_free_space_divisor((GC_word) RTS_OPTIONS.freeSpaceDivisor);
+    if (RTS_OPTIONS.incremental) GC_enable_incremental();
 
     xxHashSeed = 0xe606946923239b1c; // FIXME implement reading /dev/urandom
 
     RUNTIME = runtime;
+    initTypeRegistry(runtime->types);
+    initDataDescriptors(runtime->types);
+    initSymbols(runtime->symbols);
+    NONE.header.typeId = LAOPTION->id; // statically allocated before the Option id is known
     UNIT_STRING = makeString("()");
-    for (int i = 0; i < 256; i++) {
-        BYTE_ARRAY[i].type = LABYTE;
-        BYTE_ARRAY[i].num = i - 128;
-    }
-    for (int i = 0; i < 100; i++) {
-        INT_ARRAY[i].type = LAINT;
-        INT_ARRAY[i].num = i;
-    }
+    if (runtime->verbose || RTS_OPTIONS.stats) atexit(onexit);
     if (runtime->verbose) {
-        atexit(onexit);
         printf("Init Lasca 0.0.2 runtime. Enjoy :)\n# funcs = %"PRId64
                ", # structs = %"PRId64", utf8proc version %s\n",
           RUNTIME->functions->size, RUNTIME->types->size, utf8proc_version());
         for (int i = 0; i < RUNTIME->types->size; i++) {
-            printf("Type %s\n", RUNTIME->types->data[i]->type->name);
+            printf("Type %s, id %"PRId32"\n", RUNTIME->types->data[i]->type->name, RUNTIME->types->data[i]->type->id);
         }
     }
+    return argc;
 }
@@ -127,6 +127,12 @@ externalConst tpe nm = addDefn $ AST.GlobalDefinition $ globalVariableDefaults {
     LLVM.AST.Global.type' = tpe
 }
 
+externalGlobal tpe nm = addDefn $ AST.GlobalDefinition $ globalVariableDefaults {
+    LLVM.AST.Global.linkage = Linkage.External,
+    LLVM.AST.Global.name = Name nm,
+    LLVM.AST.Global.type' = tpe
+}
+
 ---------------------------------------------------------------------------------
 -- Types
 -------------------------------------------------------------------------------
@@ -165,11 +171,15 @@ data CodegenState
       currentBlock :: Name                     -- Name of the active block to append to
     , blocks       :: Map Name BlockState  -- Blocks for function
     , symtab       :: SymbolTable              -- Function scope symbol table
+    , unboxedLocals :: Map LT.Name LT.Type     -- Locals holding raw primitive values, with their Lasca types
     , blockCount   :: Int                      -- Count of basic blocks
     , count        :: Word                     -- Count of unnamed instructions
     , names        :: Names                    -- Name Supply
     , moduleState  :: ModuleState
     , generatedStrings :: [Text]
+    , generatedGlobals :: [(SBS.ShortByteString, Type, C.Constant)] -- mutable globals used by the function, e.g. inline caches
+    , functionName :: SBS.ShortByteString      -- Name of the function being generated
+    , functionType :: Maybe Type               -- Its LLVM type, for musttail calls, see retTail
     } deriving Show
 
 data BlockState
@@ -209,11 +219,15 @@ emptyCodegen ms = CodegenState {
     currentBlock = Name (SBS.toShort entryBlockName),
     blocks = Map.empty,
     symtab = [],
+    unboxedLocals = Map.empty,
     blockCount = 1,
     count = 0,
     names = Map.empty,
     moduleState = ms,
-    generatedStrings = []
+    generatedStrings = [],
+    generatedGlobals = [],
+    functionName = "",
+    functionType = Nothing
 }
 
 execCodegen :: [(LT.Name, Operand)] -> ModuleState -> Codegen a -> CodegenState
@@ -262,6 +276,15 @@ terminator trm = do
     modifyBlock (blk { term = Just trm })
     return trm
 
+-- Adds a mutable global to the module. Name is unique: function name, prefix and a counter.
+generateGlobal :: BS.ByteString -> Type -> C.Constant -> Codegen Operand
+generateGlobal prefix tpe initial = do
+    fn <- gets functionName
+    globals <- gets generatedGlobals
+    let name = mconcat [fn, ".", SBS.toShort prefix, ".", fromString (show (length globals))]
+    modify $ \s -> s { generatedGlobals = (name, tpe, initial) : globals }
+    return $ globalOp tpe name
+
 -------------------------------------------------------------------------------
 -- Block Stack
 -------------------------------------------------------------------------------
@@ -303,7 +326,13 @@ modifyBlock new = do
 assign :: LT.Name -> Operand -> Codegen ()
 assign var x = do
     lcls <- gets symtab
-    modify $ \s -> s { symtab = (var, x) : lcls }
+    modify $ \s -> s { symtab = (var, x) : lcls, unboxedLocals = Map.delete var (unboxedLocals s) }
+
+-- Assigns a local that holds a raw value of a primitive Lasca type instead of a Box*
+assignUnboxed :: LT.Name -> LT.Type -> Operand -> Codegen ()
+assignUnboxed var tpe x = do
+    assign var x
+    modify $ \s -> s { unboxedLocals = Map.insert var tpe (unboxedLocals s) }
 
 getvar :: LT.Name -> Codegen Operand
 getvar var = do
@@ -413,11 +442,26 @@ callIns ftype fn args = do
 callFnIns ftype name args = callIns ftype (globalOp ftype (fromString name)) args
 {-# INLINE callFnIns #-}
 
+{-
+    Allocas go to the entry block, so that locals of loop bodies don't grow the stack on every iteration.
+    They get named values, unnamed ones must be numbered in the order of their appearance.
+-}
+allocaTyped :: Type -> Type -> Maybe Operand -> Codegen Operand
+allocaTyped tpe ty size = do
+    nms <- gets names
+    let (name, supply) = uniqueName "local" nms
+        ref = Name (SBS.toShort name)
+    modify $ \s -> s { names = supply }
+    blks <- gets blocks
+    let (entryName, blk) = head $ sortBlocks $ Map.toList blks
+    modify $ \s -> s { blocks = Map.insert entryName (blk { stack = stack blk ++ [ref := Alloca ty size 0 []] }) blks }
+    return $ LocalReference tpe ref
+
 alloca :: Type -> Codegen Operand
-alloca ty = instr $ Alloca ty Nothing 0 []
+alloca ty = allocaTyped ptrType ty Nothing
 {-# INLINE alloca #-}
 
-allocaSize ty size = instr $ Alloca ty (Just size) 0 []
+allocaSize ty size = allocaTyped ptrType ty (Just size)
 
 store :: Operand -> Operand -> Codegen ()
 store ptr val = instrDo $ Store False ptr val Nothing 0 []
@@ -440,6 +484,22 @@ phi ty incoming = instr $ Phi ty incoming []
 ret :: Operand -> Codegen (Named Terminator)
 ret val = terminator $ Do $ Ret (Just val) []
 
+{-
+    Returns val from a tail position. If val is the result of a call right before the return,
+    and the callee has the signature of the current function, the call becomes musttail:
+    LLVM has to reuse the caller's frame at any optimization level.
+-}
+retTail :: Operand -> Codegen (Named Terminator)
+retTail val = do
+    blk <- current
+    ftype <- gets functionType
+    case (reverse (stack blk), val) of
+        ((ref := c@Call{function = Right (ConstantOperand (C.GlobalReference (PointerType calleeType _) _))}) : rest, LocalReference _ ref')
+            | ref == ref', Just calleeType == ftype ->
+                modifyBlock (blk { stack = reverse ((ref := c { tailCallKind = Just MustTail }) : rest) })
+        _ -> return ()
+    ret val
+
 getelementptr addr indices = instr $ GetElementPtr False addr indices []
 {-# INLINE getelementptr #-}
 
@@ -451,8 +511,6 @@ doubleTypePtrOp = globalOp ptrType "Float_LaType"
 closureTypePtrOp = globalOp ptrType "Closure_LaType"
 arrayTypePtrOp = globalOp ptrType "Array_LaType"
 
-stringTypePtr = global ptrType "String_LaType"
-stringTypePtrOp = constOp $ stringTypePtr
 
 globalStringRefAsPtr :: Text -> C.Constant
 globalStringRefAsPtr name = constRef tpe literalName
@@ -461,6 +519,13 @@ globalStringRefAsPtr name = constRef tpe literalName
     (_, len) = createString name
     tpe = stringStructType len
 
+-- Static Symbol of a name interned at compile time, see genSymbols in EmitCommon.hs
+symbolLitName :: Text -> SBS.ShortByteString
+symbolLitName s = "Symbol." <> getStringLitName s
+
+symbolLitRef :: Text -> C.Constant
+symbolLitRef s = constRef symbolStructType (symbolLitName s)
+
 one = constOp $ C.Float (F.Double 1.0)
 zero = constOp $ C.Float (F.Double 0.0)
 false = zero
@@ -485,9 +550,11 @@ createCString s = (C.Array T.i8 bytes, len)
     bytes = map constByte (ByteString.unpack bytestring ++ [fromInteger 0])
     len = ByteString.length bytestring + 1
 
-createString s = (createStruct [stringTypePtr, constInt (len - 1), array], len)
+-- the header tag caches the code point count + 1, see String in lasca.h
+createString s = (createStruct [headerConst stringTypeId codePointsTag, constInt (len - 1), array], len)
   where
     (array, len) = createCString s
+    codePointsTag = if T.length s < 2147483646 then T.length s + 1 else 0
 
 defineStringLit :: Text -> LLVM ()
 defineStringLit s = defineConst (getStringLitName s) (stringStructType len) string
@@ -496,30 +563,73 @@ defineStringLit s = defineConst (getStringLitName s) (stringStructType len) stri
 --            Lasca Runtime Data Representation Types
 funcType retTy args = T.FunctionType retTy args False
 
-stringStructType len = T.StructureType False [T.ptr ptrType, intType, T.ArrayType (fromIntegral len) T.i8]
+-- Header of every heap object: {typeId, constructor tag}. Keep in sync with Header in lasca.h
+headerType = T.StructureType False [T.i32, T.i32]
+
+headerConst typeId tag = createStruct [constInt32 typeId, constInt32 tag]
 
-laTypeStructType = T.StructureType False [ptrType]
+stringStructType len = T.StructureType False [headerType, intType, T.ArrayType (fromIntegral len) T.i8]
 
-boxStructOfType boxedType = T.StructureType False [ptrType, boxedType]
+laTypeStructType = T.StructureType False [ptrType, T.i32, T.i32, ptrType] -- LaType: {name, id, kind, Data*}
+
+boxStructOfType boxedType = T.StructureType False [headerType, boxedType]
 
 boxedIntType = boxStructOfType intType
-boxedInt16Type = boxStructOfType T.i16
-boxedInt32Type = boxStructOfType T.i32
-boxedBoolType = boxStructOfType boolType
-boxedByteType = boxStructOfType T.i8
 boxedFloatType = boxStructOfType T.double
 
-dataValueStructType len = T.StructureType False [ptrType, intType, T.ArrayType (fromIntegral len) ptrType] -- DataValue: {LaType*, tag, values: []}
-
-arrayStructType elemType = T.StructureType False [ptrType, intType, T.ArrayType 0 elemType]
+-- Keep in sync with LATYPE_ID_* and FIRST_DATA_TYPE_ID in lasca.h
+stringTypeId, closureTypeId, arrayTypeId, intArrayTypeId, floatArrayTypeId, symbolTypeId, firstDataTypeId :: Int
+stringTypeId = 8
+closureTypeId = 9
+arrayTypeId = 10
+intArrayTypeId = 12
+floatArrayTypeId = 13
+symbolTypeId = 14
+firstDataTypeId = 19
+
+-- LaType id of a data type: FIRST_DATA_TYPE_ID + index of its Data in Runtime.types
+dataTypeId :: S.Ctx -> LT.Name -> Int
+dataTypeId ctx name = case elemIndex name names of
+    Just idx -> firstDataTypeId + idx
+    Nothing -> error $ "dataTypeId: unknown data type " ++ show name
+  where names = [n | S.Data _ n _ _ <- reverse (S._dataDefs ctx)]
+
+-- LaType id and tag of the data values a constructor creates
+constructorTypeIdAndTag :: S.Ctx -> LT.Name -> Maybe (Int, Int)
+constructorTypeIdAndTag ctx ctor = case [(dataTypeId ctx dataName, tag) | (dataName, ctors) <- Map.toList (S._constructorTags ctx), Just tag <- [Map.lookup ctor ctors]] of
+    [typeIdAndTag] -> Just typeIdAndTag
+    _ -> Nothing
+
+-- DataValue: {Header {typeId, tag}, values: []}, the header is flattened so that tag and values are fields 1 and 2
+dataValueStructType len = T.StructureType False [T.i32, T.i32, T.ArrayType (fromIntegral len) ptrType]
+
+arrayStructType elemType = T.StructureType False [headerType, intType, T.ArrayType 0 elemType]
 
 positionStructType = T.StructureType False [intType, intType]
 
-closureStructType = T.StructureType False [ptrType, intType, intType, ptrType] -- Closure {LaType*, funcIdx, arc, argv}
+closureStructType = closureStructTypeOf 0
+
+closureStructTypeOf argc = T.StructureType False [headerType, intType, ptrType, intType, intType, T.ArrayType (fromIntegral argc) ptrType] -- Closure {Header, funcIdx, funcPtr, arity, argc, argv[]}
 
 functionStructType = T.StructureType False [ptrType, ptrType, intType]
 
+-- Symbol {Header, hash, id, String* name}. Keep in sync with Symbol in lasca.h
+symbolStructType = T.StructureType False [headerType, intType, intType, ptrType]
+
+-- Size and alignment in bytes of the types heap objects are made of, on 64 bit targets
+typeSizeAndAlign :: Type -> (Int, Int)
+typeSizeAndAlign tpe = case tpe of
+    IntegerType bits -> let n = max 1 (fromIntegral bits `div` 8) in (n, n)
+    PointerType{} -> (8, 8)
+    ArrayType n elemType -> let (size, align) = typeSizeAndAlign elemType in (fromIntegral n * size, align)
+    StructureType False elems -> let (size, align) = foldl field (0, 1) elems in (alignTo align size, align)
+    _ | tpe == T.double -> (8, 8)
+    _ -> error $ "typeSizeAndAlign: unsupported type " ++ show tpe
+  where
+    field (offset, align) t = let (s, a) = typeSizeAndAlign t in (alignTo a offset + s, max align a)
+    alignTo a n = (n + a - 1) `div` a * a
+
 functionsStructType len = T.StructureType False [intType, arrayTpe len]
   where arrayTpe len = T.ArrayType len functionStructType
 
-runtimeStructType = T.StructureType False [ptrType, ptrType, boolType]
\ No newline at end of file
+runtimeStructType = T.StructureType False [ptrType, ptrType, ptrType, boolType] -- Runtime {functions, types, symbols, verbose}
\ No newline at end of file
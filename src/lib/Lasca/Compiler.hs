@@ -67,11 +67,19 @@ runPhases opts filename = do
     typed <- if mode opts == Static
              then typerPhase opts ctx filename desugared
              else return desugared
-    let desugared2 = patmatPhase ctx typed
-    let desugared3 = lambdaLiftPhase ctx desugared2 -- must be after typechecking
-    let !desugared4 = delambdafyPhase ctx desugared3 -- must be after typechecking
-    when (printAst opts) $ putStrLn $ intercalate "\n" (map printExprWithType desugared4)
-    let mod = codegenPhase ctx filename desugared4 mainFunctionName
+    let specialized = if mode opts == Static && specializeBudget opts > 0
+                      then specializePhase ctx typed
+                      else typed
+    let desugared2 = patmatPhase ctx specialized
+    let known = knownConstructorsPhase ctx desugared2
+    let loops = loopsPhase ctx known
+    let promoted = promoteVarsPhase ctx loops
+    let desugared3 = lambdaLiftPhase ctx promoted -- must be after typechecking
+    let desugared4 = delambdafyPhase ctx desugared3 -- must be after typechecking
+    let desugared5 = tailLoopsPhase ctx desugared4 -- must be after lambda lifting
+    let !desugared6 = stackAllocPhase ctx desugared5
+    when (printAst opts) $ putStrLn $ intercalate "\n" (map printExprWithType desugared6)
+    let mod = codegenPhase ctx filename desugared6 mainFunctionName
     if exec opts then do
         when (verboseMode opts) $ putStrLn "Running JIT"
         runJIT opts mod
@@ -93,16 +101,18 @@ codegenPhase context filename exprs mainFunctionName = do
     let opts = _lascaOpts context
     let modo = emptyModule filename
     let cgen = if mode opts == Static then EmitStatic.cgen else EmitDynamic.cgen
+    let cgenBody = if mode opts == Static then EmitStatic.cgenBody else EmitDynamic.cgenBody
     let ctx = collectGlobals context exprs
     runLLVM modo $  do
         declareStdFuncs
         fmt <- genFunctionMap exprs
         let defs = reverse (_dataDefs ctx)
         tst <- genTypesStruct ctx defs
-        genRuntime opts fmt tst
+        syms <- genSymbols ctx (internedLiterals exprs)
+        genRuntime opts fmt tst syms
         forM_ exprs $ \expr -> do
             defineStringConstants expr
-            codegenTop ctx cgen expr
+            codegenTop ctx cgenBody expr
         codegenStartFunc ctx cgen mainFunctionName
 
 processMainFile :: LascaOpts -> String -> IO ()
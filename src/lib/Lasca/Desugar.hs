@@ -20,6 +20,7 @@ import qualified Data.List as List
 import Data.Word
 import Data.Int
 import Control.Monad.State
+import Data.Functor.Identity
 import Control.Monad.Except
 import Control.Applicative
 import qualified Control.Lens as Lens
@@ -45,7 +46,9 @@ data DesugarPhaseState = DesugarPhaseState {
     _outers :: Map Name Type.Type,
     _usedVars :: Set Name,
     _syntacticAst :: [Expr],
-    _freshId :: Int
+    _freshId :: Int,
+    _specializations :: Map (Name, [Type.Type]) Name, -- (function, instance types) -> specialized copy
+    _specializationBudget :: Int
 } deriving (Show)
 makeLenses ''DesugarPhaseState
 
@@ -56,7 +59,9 @@ emptyDesugarPhaseState = DesugarPhaseState {
     _outers = Map.empty,
     _usedVars = Set.empty,
     _syntacticAst = [],
-    _freshId = 1
+    _freshId = 1,
+    _specializations = Map.empty,
+    _specializationBudget = 0
 }
 
 freshName n = do
@@ -84,6 +89,13 @@ transformExpr transformer expr = case expr of
         true' <- go true
         false' <- go false
         transformer (If meta cond' true' false')
+    Switch meta e cases dflt -> do
+        e' <- go e
+        cases' <- forM cases $ \(tag, expr) -> do
+            expr' <- go expr
+            return (tag, expr')
+        dflt' <- go dflt
+        transformer (Switch meta e' cases' dflt')
     Match meta expr cases -> do
         expr1 <- go expr
         cases1 <- forM cases $ \(Case p expr) -> do
@@ -194,6 +206,13 @@ lambdaLiftPhase ctx exprs = let
               true' <- go true
               false' <- go false
               return (If meta cond' true' false')
+          Switch meta e cases dflt -> do
+              e' <- go e
+              cases' <- forM cases $ \(tag, expr) -> do
+                  expr' <- go expr
+                  return (tag, expr')
+              dflt' <- go dflt
+              return (Switch meta e' cases' dflt')
           Match meta expr cases -> do
               expr1 <- go expr
               cases1 <- forM cases $ \(Case p expr) -> do
@@ -284,6 +303,13 @@ delambdafyPhase ctx exprs = let
               true' <- go true
               false' <- go false
               return (If meta cond' true' false')
+          Switch meta e cases dflt -> do
+              e' <- go e
+              cases' <- forM cases $ \(tag, expr) -> do
+                  expr' <- go expr
+                  return (tag, expr')
+              dflt' <- go dflt
+              return (Switch meta e' cases' dflt')
           Match meta expr cases -> do
               expr1 <- go expr
               cases1 <- forM cases $ \(Case p expr) -> do
@@ -375,14 +401,448 @@ patmatPhase ctx exprs = let
         return expr2
 
 
+{-
+    Specialization of polymorphic toplevel functions.
+    For every use of a polymorphic function at an instantiation with a primitive type,
+    e.g. foldl at Int, we create a typed copy of the function, foldl[Int], and use it instead.
+    Copies are monomorphic, so the static emitter keeps primitive values unboxed inside them.
+    Copies are specialized recursively. The total size of the copies is limited by --specialize budget.
+-}
+specializePhase ctx exprs = let
+    st = emptyDesugarPhaseState { _specializationBudget = Opts.specializeBudget (_lascaOpts ctx) }
+    (specialized, st') = runState (forM exprs specializeTop) st
+    syn = _syntacticAst st'
+  in specialized ++ syn
+
+  where
+    polymorphic = Map.fromList [(name, e) | e@(Let True meta name _ _ EmptyExpr) <- exprs,
+                                            not (meta ^. isExternal), isPolymorphic (meta ^. exprType)]
+
+    isPolymorphic (Forall (_ : _) _) = True
+    isPolymorphic _ = False
+
+    specializeTop expr = case expr of
+        Let True _ name _ _ _ | name `Map.member` polymorphic -> return expr
+        _ -> transformExpr specializeIdent expr
+
+    specializeIdent expr = case expr of
+        Ident meta name | Just f <- Map.lookup name polymorphic -> do
+            lcls <- gets _locals
+            outer <- gets _outers
+            if name `Map.member` lcls || name `Map.member` outer then return expr else do
+                specialized <- specializeFunc f (typeOf expr)
+                return $ maybe expr (Ident meta) specialized
+        _ -> return expr
+
+    specializeFunc f@(Let True meta name tpe lam _) instanceType = do
+        let Forall tvars genericType = meta ^. exprType
+        case matchTypes genericType instanceType of
+            Just subst | all (isConcrete . snd) (Map.toList subst) && any isPrimitive (Map.elems subst) && Map.size subst == length tvars -> do
+                let types = map (subst Map.!) tvars
+                existing <- gets (Map.lookup (name, types) . _specializations)
+                budget <- gets _specializationBudget
+                let size = exprSize lam
+                case existing of
+                    Just specialized -> return (Just specialized)
+                    Nothing | size > budget -> return Nothing
+                    Nothing -> do
+                        let specializedName = specializeName name types
+                        specializationBudget -= size
+                        specializations %= Map.insert (name, types) specializedName
+                        let copy = Let True (meta `withType` substitute subst genericType) specializedName tpe (substituteAll subst lam) EmptyExpr
+                        -- the copy is monomorphic, specialize its calls too, keeping the state of the current function
+                        saved <- get
+                        copy' <- transformExpr specializeIdent copy
+                        modify (\s -> s { _locals = _locals saved, _outers = _outers saved,
+                                          _functionStack = _functionStack saved, _usedVars = _usedVars saved })
+                        syntacticAst %= (++ [copy'])
+                        return (Just specializedName)
+            _ -> return Nothing
+
+    specializeName (NS prefix n) types = NS prefix (specializeName n types)
+    specializeName (Name n) types = Name $ T.concat [n, "[", T.intercalate "," (map (T.pack . show) types), "]"]
+
+    matchTypes (TVar v) t = Just (Map.singleton v t)
+    matchTypes (TypeIdent a) (TypeIdent b) | a == b = Just Map.empty
+    matchTypes (TypeFunc a b) (TypeFunc c d) = join $ mergeSubst <$> matchTypes a c <*> matchTypes b d
+    matchTypes (TypeApply t as) (TypeApply u bs) | length as == length bs =
+        foldM (\acc (a, b) -> matchTypes a b >>= mergeSubst acc) Map.empty ((t, u) : zip as bs)
+    matchTypes _ _ = Nothing
+
+    mergeSubst s1 s2 | and (Map.elems (Map.intersectionWith (==) s1 s2)) = Just (Map.union s1 s2)
+                     | otherwise = Nothing
+
+    isConcrete t = Set.null (ftv t) && not (containsAny t)
+    containsAny TypeAny = True
+    containsAny (TypeFunc a b) = containsAny a || containsAny b
+    containsAny (TypeApply t args) = any containsAny (t : args)
+    containsAny _ = False
+
+    isPrimitive t = t `elem` [TypeBool, TypeByte, TypeInt, TypeInt16, TypeInt32, TypeFloat]
+
+exprSize expr = case expr of
+    Apply _ f args -> 1 + exprSize f + sum (map exprSize args)
+    Lam _ _ e -> 1 + exprSize e
+    Select _ tree e -> 1 + exprSize tree + exprSize e
+    Match _ e cases -> 1 + exprSize e + sum [exprSize e | Case _ e <- cases]
+    If _ cond tr fl -> 1 + exprSize cond + exprSize tr + exprSize fl
+    Let _ _ _ _ e body -> 1 + exprSize e + exprSize body
+    Array _ exprs -> 1 + sum (map exprSize exprs)
+    _ -> 1
+
+-- Direct subexpressions of an expression
+children expr = case expr of
+    Apply _ f args -> f : args
+    Lam _ _ e -> [e]
+    Select _ tree e -> [tree, e]
+    Match _ e cases -> e : [e | Case _ e <- cases]
+    If _ cond tr fl -> [cond, tr, fl]
+    Switch _ e cases dflt -> e : map snd cases ++ [dflt]
+    Let _ _ _ _ e body -> [e, body]
+    Array _ exprs -> exprs
+    _ -> []
+
+mapChildren f expr = runIdentity $ mapChildrenM (Identity . f) expr
+
+mapChildrenM f expr = case expr of
+    Apply meta e args -> Apply meta <$> f e <*> mapM f args
+    Lam meta arg e -> Lam meta arg <$> f e
+    Select meta tree e -> Select meta <$> f tree <*> f e
+    Match meta e cases -> Match meta <$> f e <*> sequence [Case p <$> f e | Case p e <- cases]
+    If meta cond tr fl -> If meta <$> f cond <*> f tr <*> f fl
+    Switch meta e cases dflt -> Switch meta <$> f e <*> sequence [(,) tag <$> f e | (tag, e) <- cases] <*> f dflt
+    Let r meta n tpe e body -> Let r meta n tpe <$> f e <*> f body
+    Array meta exprs -> Array meta <$> mapM f exprs
+    _ -> return expr
+
+-- String literals interned with String.intern, codegen refers to their compile time Symbols
+internedLiterals :: [Expr] -> [Text]
+internedLiterals = concatMap go
+  where
+    go (Apply _ (Ident _ (NS "String" "intern")) [Literal _ (StringLit s)]) = [s]
+    go expr = concatMap go (children expr)
+
+mentions name expr = case expr of
+    Ident _ n -> n == name
+    _ -> any (mentions name) (children expr)
+
+{-
+    Calls of Prelude.for, Array.foreach, Array.transform and String.iterate with a lambda literal
+    become native loops, Prelude.whileLoop(cond, body), with the lambda body inlined.
+    Counters are mutable locals assigned with Prelude.assignLocal.
+    Lambda arguments are renamed to fresh locals: the emitters don't scope locals.
+    Runs before promoteVarsPhase, so Vars that were only captured by such lambdas get promoted too.
+-}
+loopsPhase ctx exprs = evalState (mapM lowerLoops exprs) emptyDesugarPhaseState
+  where
+    lowerLoops expr = mapChildrenM lowerLoops expr >>= lowerLoop
+
+    lowerLoop expr = case expr of
+        Apply meta (Ident _ (NS "Prelude" "for")) [start, end, Lam _ (Arg i _) body] -> do
+            counter <- freshName "$for"
+            endName <- freshName "$end"
+            (i', body') <- bindArg i body
+            step <- stmt body' (increment counter)
+            -- start is evaluated before end, like the arguments of for
+            return $ letIn meta counter start $ letIn meta endName end $
+                whileLoop (intOp "<" (ref counter TypeInt) (ref endName TypeInt) TypeBool) $
+                    letIn emptyMeta i' (ref counter TypeInt) step
+        Apply meta (Ident _ (NS "Array" "foreach")) [array, Lam _ (Arg x _) body] -> do
+            (x', body') <- bindArg x body
+            arrayLoop meta array $ \arrayName counter -> do
+                step <- stmt body' (increment counter)
+                return $ letIn emptyMeta x' (getIndex array arrayName counter) step
+        Apply meta (Ident _ (NS "Array" "transform")) [array, Lam _ (Arg i _) (Lam _ (Arg x _) body)] -> do
+            (i', body1) <- bindArg i body
+            (x', body2) <- bindArg x body1
+            arrayLoop meta array $ \arrayName counter -> do
+                let arrayType = typeOf array
+                    setIndex = Apply (metaType TypeUnit) (Ident (metaType (arrayType ==> TypeInt ==> elemType arrayType ==> TypeUnit)) (NS "Array" "setIndex"))
+                                     [ref arrayName arrayType, ref counter TypeInt, body2]
+                step <- stmt setIndex (increment counter)
+                return $ letIn emptyMeta i' (ref counter TypeInt) $ letIn emptyMeta x' (getIndex array arrayName counter) step
+        Apply meta (Ident _ (NS "String" "iterate")) [string, Lam _ (Arg c _) body] -> do
+            stringName <- freshName "$string"
+            len <- freshName "$len"
+            offset <- freshName "$offset"
+            continue <- freshName "$continue"
+            (c', body') <- bindArg c body
+            let codePoint = Apply (metaType TypeInt32) (Ident (metaType (TypeString ==> TypeInt ==> TypeInt32)) (NS "String" "codePointAtOffset"))
+                                  [ref stringName TypeString, ref offset TypeInt]
+                byteLength = Apply (metaType TypeInt) (Ident (metaType (TypeInt32 ==> TypeInt)) (NS "String" "codePointByteLength")) [ref c' TypeInt32]
+                bytesCount = Apply (metaType TypeInt) (Ident (metaType (TypeString ==> TypeInt)) (NS "String" "bytesCount")) [ref stringName TypeString]
+                cond = If (metaType TypeBool) (ref continue TypeBool) (intOp "<" (ref offset TypeInt) (ref len TypeInt) TypeBool) (boolLit False)
+            step <- stmt (assign offset (intOp "+" (ref offset TypeInt) byteLength TypeInt)) (assign continue body')
+            return $ letIn meta stringName string $ letIn meta len bytesCount $
+                letIn meta offset (intLit 0) $ letIn meta continue (boolLit True) $
+                    whileLoop cond $ letIn emptyMeta c' codePoint step
+        _ -> return expr
+
+    -- Loops over the indices of the array, body gets the names of the array and the counter locals
+    arrayLoop meta array body = do
+        arrayName <- freshName "$array"
+        len <- freshName "$len"
+        counter <- freshName "$i"
+        let arrayType = typeOf array
+            arrayLength = Apply (metaType TypeInt) (Ident (metaType (arrayType ==> TypeInt)) (NS "Array" "length")) [ref arrayName arrayType]
+        loopBody <- body arrayName counter
+        return $ letIn meta arrayName array $ letIn meta len arrayLength $ letIn meta counter (intLit 0) $
+            whileLoop (intOp "<" (ref counter TypeInt) (ref len TypeInt) TypeBool) loopBody
+
+    bindArg name body = do
+        name' <- freshName ("$" ++ T.unpack (nameToText name))
+        return (name', renameLocal name name' body)
+
+    elemType (TypeArray t) = t
+    elemType _ = TypeAny
+
+    getIndex array arrayName counter =
+        let arrayType = typeOf array
+        in Apply (metaType (elemType arrayType)) (Ident (metaType (arrayType ==> TypeInt ==> elemType arrayType)) (NS "Array" "getIndex"))
+              [ref arrayName arrayType, ref counter TypeInt]
+
+    increment counter = assign counter (intOp "+" (ref counter TypeInt) (intLit 1) TypeInt)
+
+    ref name tpe = Ident (metaType tpe) name
+    intLit n = Literal (metaType TypeInt) (IntLit n)
+    boolLit b = Literal (metaType TypeBool) (BoolLit b)
+    intOp op lhs rhs tpe = Apply (metaType tpe) (Ident (metaType (TypeInt ==> TypeInt ==> tpe)) op) [lhs, rhs]
+    letIn meta name value body = Let False meta name TypeAny value body
+    assign name value = Apply (metaType TypeUnit) (Ident (metaType TypeUnit) (NS "Prelude" "assignLocal")) [ref name (typeOf value), value]
+    whileLoop cond body = Apply (metaType TypeUnit) (Ident (metaType TypeUnit) (NS "Prelude" "whileLoop")) [cond, body]
+    stmt e rest = do
+        name <- freshName "$stmt"
+        return $ letIn emptyMeta name e rest
+
+{-
+    Self tail calls become loops.
+    A toplevel function that calls itself in tail position runs its body in Prelude.whileLoop:
+    a self tail call assigns the new arguments to the parameters and loops again,
+    any other value in tail position is assigned to the result local and stops the loop.
+    Runs after lambda lifting, so closures have already copied the parameters they enclose.
+-}
+tailLoopsPhase ctx exprs = evalState (mapM loopify exprs) emptyDesugarPhaseState
+  where
+    loopify expr = case expr of
+        Let True meta name tpe lam EmptyExpr
+            | not (meta ^. isExternal)
+            , (args, body) <- uncurryLambda lam
+            , body /= EmptyExpr
+            , name `notElem` [n | Arg n _ <- args]
+            , hasSelfTailCall name (length args) body
+            , Just resultType <- funcResultType (length args) (typeOf lam)
+            , Just initial <- placeholder resultType -> do
+                result <- freshName "$result"
+                continue <- freshName "$loop"
+                body' <- loopBody name args result continue body
+                loop <- stmt (whileLoop (ref continue TypeBool) body') (ref result resultType)
+                let newBody = letIn meta result initial $ letIn meta continue (boolLit True) loop
+                return $ Let True meta name tpe (withBody (length args) lam newBody) EmptyExpr
+        _ -> return expr
+
+    hasSelfTailCall name arity expr = case expr of
+        Apply _ (Ident _ n) args -> n == name && length args == arity
+        If _ _ tr fl -> hasSelfTailCall name arity tr || hasSelfTailCall name arity fl
+        Let False _ n _ _ body -> n /= name && hasSelfTailCall name arity body
+        Switch _ _ cases dflt -> any (hasSelfTailCall name arity . snd) cases || hasSelfTailCall name arity dflt
+        _ -> False
+
+    loopBody name args result continue expr = case expr of
+        Apply _ (Ident _ n) values | n == name && length values == length args -> do
+            temps <- forM values $ \_ -> freshName "$arg"
+            assigns <- foldM (\rest (Arg param _, temp, value) -> stmt (assign param (ref temp (typeOf value))) rest)
+                             (Literal (metaType TypeUnit) UnitLit) (reverse $ zip3 args temps values)
+            return $ foldr (\(temp, value) rest -> letIn emptyMeta temp value rest) assigns (zip temps values)
+        If meta cond tr fl -> If (unitMeta meta) cond <$> loopBody name args result continue tr <*> loopBody name args result continue fl
+        Let False meta n tpe value body | n /= name -> Let False (unitMeta meta) n tpe value <$> loopBody name args result continue body
+        Switch meta scrutinee cases dflt -> do
+            cases' <- forM cases $ \(lit, e) -> (,) lit <$> loopBody name args result continue e
+            Switch (unitMeta meta) scrutinee cases' <$> loopBody name args result continue dflt
+        _ -> stmt (assign result expr) (assign continue (boolLit False))
+
+    unitMeta meta = meta `withType` TypeUnit
+
+    withBody 0 _ body = body
+    withBody n (Lam meta arg e) body = Lam meta arg (withBody (n - 1) e body)
+    withBody _ e _ = e
+
+    funcResultType 0 t = Just t
+    funcResultType n (TypeFunc _ r) = funcResultType (n - 1) r
+    funcResultType _ _ = Nothing
+
+    -- the initial value of the result local, it's never read
+    placeholder tpe = case tpe of
+        TypeInt -> Just $ Literal (metaType TypeInt) (IntLit 0)
+        TypeFloat -> Just $ Literal (metaType TypeFloat) (FloatLit 0.0)
+        TypeBool -> Just $ boolLit False
+        _ | tpe `elem` [TypeByte, TypeInt16, TypeInt32] -> Nothing
+        _ -> Just $ Literal (metaType tpe) UnitLit
+
+    ref name tpe = Ident (metaType tpe) name
+    boolLit b = Literal (metaType TypeBool) (BoolLit b)
+    letIn meta name value body = Let False meta name TypeAny value body
+    assign name value = Apply (metaType TypeUnit) (Ident (metaType TypeUnit) (NS "Prelude" "assignLocal")) [ref name (typeOf value), value]
+    whileLoop cond body = Apply (metaType TypeUnit) (Ident (metaType TypeUnit) (NS "Prelude" "whileLoop")) [cond, body]
+    stmt e rest = do
+        name <- freshName "$stmt"
+        return $ letIn emptyMeta name e rest
+
+{-
+    Case of known constructor.
+    For `let x = C(a, b)` switches on the constructor tag of x take the branch of C,
+    and reads of C's fields of x become locals bound to a and b.
+    When nothing else uses x, the data value isn't created at all,
+    e.g. a value matched right where it's constructed.
+-}
+knownConstructorsPhase ctx exprs = evalState (mapM (\expr -> toplevelValueM (known (boundNames expr) Map.empty) expr) exprs) emptyDesugarPhaseState
+  where
+    -- env: local -> its constructor and the locals bound to the constructor arguments
+    known bound env expr = case expr of
+        Let False meta name tpe value body | Just (ctor, args) <- constructorApply bound value -> do
+            args' <- mapM (known bound env) args
+            names <- forM args $ \_ -> freshName "$field"
+            body' <- known bound (Map.insert name (ctor, names) env) body
+            let refs = [Ident (metaType (typeOf arg)) n | (n, arg) <- zip names args]
+                binding = case value of
+                    Apply m f _ -> Let False meta name tpe (Apply m f refs) body'
+                    _ -> Let False meta name tpe value body'
+                result = if mentions name body' then binding else body'
+            return $ foldr (\(n, arg) acc -> Let False emptyMeta n TypeAny arg acc) result (zip names args')
+        Let False meta name tpe (Ident imeta other) body | Just k <- Map.lookup other env -> do
+            body' <- known bound (Map.insert name k env) body
+            return $ if mentions name body' then Let False meta name tpe (Ident imeta other) body' else body'
+        Let False meta name tpe value body -> Let False meta name tpe <$> known bound env value <*> known bound (Map.delete name env) body
+        Let True meta name tpe value body -> Let True meta name tpe <$> known bound (Map.delete name env) value <*> known bound (Map.delete name env) body
+        Lam meta arg@(Arg n _) body -> Lam meta arg <$> known bound (Map.delete n env) body
+        Switch meta (Apply _ (Ident _ (NS "Prelude" "runtimeDataTag")) [Ident _ n, Literal _ (IntLit typeId)]) cases dflt
+            | Just (ctor, _) <- Map.lookup n env, Just (ctorTypeId, tag) <- constructorTypeIdAndTag ctx ctor ->
+                let branch = if ctorTypeId == typeId then fromMaybe dflt (lookup tag cases) else dflt
+                in known bound env branch
+        Select meta (Ident _ n) (Ident _ field)
+            | Just (ctor, names) <- Map.lookup n env, Just idx <- constructorFieldIndex ctx bound ctor field ->
+                return $ Ident meta (names !! idx)
+        _ -> mapChildrenM (known bound env) expr
+
+    constructorApply bound expr = case expr of
+        Apply _ (Ident _ ctor) args | Just fields <- constructorFields ctx bound ctor, length fields == length args -> Just (ctor, args)
+        Ident _ ctor | Just [] <- constructorFields ctx bound ctor -> Just (ctor, [])
+        _ -> Nothing
+
+-- Fields of a constructor, unless a local of the same name shadows it
+constructorFields ctx bound name
+    | name `Set.member` bound = Nothing
+    | otherwise = Map.lookup name (ctx ^. constructorArgs)
+
+-- Names bound by lets and lambdas in expr
+boundNames expr = case expr of
+    Let _ _ n _ _ _ -> Set.insert n children'
+    Lam _ (Arg n _) _ -> Set.insert n children'
+    _ -> children'
+  where children' = Set.unions (map boundNames (children expr))
+
+{-
+    Index of a field of the constructor if x.field reads it.
+    In dynamic mode x.field is a function application when a global or a local is called field,
+    see cgenSelect in EmitDynamic.hs, bound are the names of the locals.
+-}
+constructorFieldIndex ctx bound ctor field = do
+    fields <- Map.lookup ctor (ctx ^. constructorArgs)
+    idx <- List.findIndex (\(Arg n _) -> n == field) fields
+    let isDefined = field `Set.member` bound || field `Map.member` (ctx ^. globalFunctions) || field `Map.member` (ctx ^. globalVals)
+    if isStaticMode ctx || not isDefined then Just idx else Nothing
+
+{-
+    Escape analysis of constructor applications and closures bound to locals.
+    The value doesn't escape when its local is only used to read fields of the constructor,
+    to switch on the constructor tag, or to call the closure.
+    Such values are annotated with stackAllocated, and the emitters allocate them
+    in the function's frame instead of the GC heap. The GC still sees their fields: it scans the stack.
+    Runs last, when closures are explicit and self tail calls are loops.
+-}
+stackAllocPhase ctx exprs = map (\expr -> toplevelValue (stackAlloc (boundNames expr)) expr) exprs
+  where
+    stackAlloc bound expr = case expr of
+        Let False meta name tpe value body | Just ctor <- allocation bound value, not (escapes bound name ctor body) ->
+            Let False meta name tpe (mapChildren (stackAlloc bound) value & metaLens . annots %~ (stackAllocated :)) (stackAlloc bound body)
+        _ -> mapChildren (stackAlloc bound) expr
+
+    -- Just the constructor, or Just Nothing for a closure
+    allocation bound expr = case expr of
+        Apply _ (Ident _ ctor) args | Just fields <- constructorFields ctx bound ctor, not (null args), length fields == length args -> Just (Just ctor)
+        Closure{} -> Just Nothing
+        _ -> Nothing
+
+    escapes bound name ctor expr = case expr of
+        Ident _ n -> n == name
+        Select _ (Ident _ n) (Ident _ field) | n == name -> isNothing (ctor >>= \c -> constructorFieldIndex ctx bound c field)
+        Apply _ (Ident _ (NS "Prelude" "runtimeDataTag")) [Ident _ n, _] | n == name -> False
+        Apply _ (Ident _ n) args | n == name, isNothing ctor -> any (escapes bound name ctor) args
+        Let False _ n _ value body | n == name -> escapes bound name ctor value
+        Closure _ _ enclosed -> any (\(Arg n _) -> n == name) enclosed
+        _ -> any (escapes bound name ctor) (children expr)
+
+-- Applies a transformation of locals to the value of a toplevel definition: the toplevel Let itself binds a global
+toplevelValue f expr = runIdentity $ toplevelValueM (Identity . f) expr
+
+toplevelValueM f expr = case expr of
+    Let r meta name tpe value EmptyExpr -> (\value' -> Let r meta name tpe value' EmptyExpr) <$> f value
+    _ -> return expr
+
+-- Renames a local, stopping where it's shadowed
+renameLocal old new expr = case expr of
+    Ident meta n | n == old -> Ident meta new
+    Lam _ (Arg n _) _ | n == old -> expr
+    Let False meta n tpe e body | n == old -> Let False meta n tpe (renameLocal old new e) body
+    Let True _ n _ _ _ | n == old -> expr
+    _ -> mapChildren (renameLocal old new) expr
+
+{-
+    Scalar replacement of Var cells.
+    A `var x = e` that never leaves its function doesn't need a heap cell:
+    x is only read with x.readVar, only assigned with x := v where the result of the assignment is discarded,
+    and no lambda or inner function mentions x.
+    Such x becomes a mutable local (an alloca in the emitters), x.readVar becomes x,
+    and x := v becomes Prelude.assignLocal(x, v).
+    Captured Vars keep their cells: lifted functions get their enclosed values by copy.
+-}
+promoteVarsPhase ctx exprs = map (toplevelValue promote) exprs
+  where
+    promote expr = case expr of
+        Let False meta name tpe (Apply _ (Ident _ (NS "Prelude" "Var")) [initial]) body
+            | staysLocal name False body -> Let False meta name tpe (promote initial) (promote (replaceVar name body))
+        _ -> mapChildren promote expr
+
+    -- discarded is True when the value of expr isn't used
+    staysLocal name discarded expr = case expr of
+        Ident _ n -> n /= name
+        Select _ (Ident _ n) (Ident _ (NS "Prelude" "readVar")) | n == name -> True
+        Apply _ (Ident _ (NS "Prelude" "writeVar")) [Ident _ n, value] | n == name ->
+            discarded && staysLocal name False value
+        Let False _ n _ e body
+            | n == name -> staysLocal name False e -- shadowed
+            | otherwise -> staysLocal name (not $ mentions n body) e && staysLocal name discarded body
+        If _ cond tr fl -> staysLocal name False cond && staysLocal name discarded tr && staysLocal name discarded fl
+        Switch _ e cases dflt ->
+            staysLocal name False e && all (staysLocal name discarded . snd) cases && staysLocal name discarded dflt
+        Lam{} -> not $ mentions name expr
+        Let True _ _ _ lam body -> not (mentions name lam) && staysLocal name discarded body
+        _ -> all (staysLocal name False) (children expr)
+
+    replaceVar name expr = case expr of
+        Select meta (Ident _ n) (Ident _ (NS "Prelude" "readVar")) | n == name -> Ident meta name
+        Apply meta (Ident imeta (NS "Prelude" "writeVar")) [var@(Ident _ n), value] | n == name ->
+            Apply meta (Ident imeta (NS "Prelude" "assignLocal")) [var, replaceVar name value]
+        Let False meta n tpe e body | n == name -> Let False meta n tpe (replaceVar name e) body
+        _ -> mapChildren (replaceVar name) expr
+
 --genMatch :: Ctx -> Expr -> Expr
 genMatch ctx m@(Match meta expr []) = error $ "Should be at least on case in match expression: " ++ show m
 genMatch ctx m@(Match meta expr cases) = do
     matchName <- freshName "$match"
     let resultType = meta ^. exprType
     let exprType = typeOf expr
-    let body = foldr (\(Case p e) acc -> genPattern ctx exprType resultType (Ident (expr ^. metaLens) matchName) p e acc
-                      ) (genFail ctx resultType) cases
+    let rows = [MatchRow [p] [] e | Case p e <- cases]
+    body <- compileMatch ctx resultType [(Ident (expr ^. metaLens) matchName, exprType)] rows
     let res = Let False (withType meta resultType) matchName TypeAny expr body
 --    Debug.traceM $ printf "getMatch rewrite:\n%s\n============= becomes =========\n%s" (show m) (show res)
     return $ res
@@ -393,40 +853,114 @@ genFail ctx resultType = do
     let expr = Apply (metaType resultType) die [Literal (metaType TypeString) $ StringLit "Match error!"]
     expr
 
-genPattern ctx exprType resultType lhs ptrn rhs = case ptrn of
-    WildcardPattern -> const rhs
-    VarPattern name -> const (Let False (metaType resultType) name TypeAny lhs rhs)
-    LitPattern literal -> do
-      let eqFun = Ident (metaType $ exprType ==> exprType ==> TypeBool) "=="
-      let applyEq = Apply (metaType TypeBool) eqFun [lhs, Literal (metaType exprType) literal]
-      If (metaType resultType) applyEq rhs
-    ConstrPattern name args -> cond
+{-
+    Pattern matrix row: patterns to match against the occurrences (scrutinee and its fields),
+    variables bound so far, and the case body.
+-}
+data MatchRow = MatchRow [Pattern] [(Name, Expr)] Expr
+
+{-
+    Compiles a pattern matrix into a decision tree.
+    Each node tests one occurrence once: constructor patterns become a Switch on the constructor tag,
+    Int literals a Switch on the value, other literals an If chain.
+    Fields are loaded once per branch into fresh locals, and only if some pattern looks at them.
+    Rows that can't be decided by the test (variables, wildcards, values of other types)
+    go to the default branch, keeping the tested column.
+-}
+compileMatch ctx resultType occs [] = return $ genFail ctx resultType
+compileMatch ctx resultType occs rows@(MatchRow ptrns binds body : _) =
+    case List.findIndex isRefutable ptrns of
+        Nothing -> do
+            let vars = binds ++ [(name, occ) | (VarPattern name, (occ, _)) <- zip ptrns occs]
+            return $ foldr (\(name, occ) acc -> Let False (metaType resultType) name TypeAny occ acc) body vars
+        Just col -> case ptrns !! col of
+            ConstrPattern name _ -> switchConstr col name
+            LitPattern (IntLit _) -> switchInt col
+            LitPattern lit -> ifLit col lit
+  where
+    isRefutable (ConstrPattern _ _) = True
+    isRefutable (LitPattern _) = True
+    isRefutable _ = False
+
+    column col (MatchRow ps _ _) = ps !! col
+
+    -- rows specialized for a matched head: the column is replaced by head's sub-patterns
+    specialize col occ arity isHead = mapMaybe specializeRow rows
       where
-        cond fail = If (metaType resultType) constrCheck (checkArgs name fail) fail
-
-        ctorTag tpe ctorName = do
-            let tpName = typeName tpe
-                ctors = fromMaybe (error "ctorTag") $ Map.lookup tpName $ ctx ^. constructorTags
-                tag = fromMaybe (error "ctorTag") $ Map.lookup ctorName ctors
-            tag
-
-        constrCheck = if isStaticMode ctx
-            then do
-                let tag = ctorTag exprType name
-                    checkTag = Ident (metaType $ exprType ==> TypeInt ==> TypeBool) (NS "Prelude" "runtimeCheckTag")
-                Apply (metaType TypeBool) checkTag [lhs, Literal (metaType TypeInt) (IntLit tag)]
-            else do
-                let isConstr = Ident (metaType $ exprType ==> TypeString ==> TypeBool) (NS "Prelude" "runtimeIsConstr")
-                    ctorName = Literal (metaType TypeString) $ StringLit (nameToText name)
-                Apply (metaType TypeBool) isConstr [lhs, ctorName]
-        constrMap = ctx ^. constructorArgs
-        checkArgs nm fail =  case Map.lookup nm constrMap of
-            Nothing -> fail
-            Just constrArgs | length args == length constrArgs -> do
-                let argParam = zip args constrArgs
-                foldr (\(a, Arg n t) acc -> do
-                        let select = Select (metaType t) lhs (Ident (metaType $ exprType ==> t) n)
-                        genPattern ctx t resultType select a acc fail
-                    ) rhs argParam
-            Just constrArgs -> error $ printf "Constructor %s has %d parameters, but %d given"
-                (show nm) (length constrArgs) (length args) -- TODO box this error
+        specializeRow (MatchRow ps bs e) = case ps !! col of
+            VarPattern name -> Just $ MatchRow (replaceAt col (replicate arity WildcardPattern) ps) (bs ++ [(name, occ)]) e
+            WildcardPattern -> Just $ MatchRow (replaceAt col (replicate arity WildcardPattern) ps) bs e
+            p | isHead p -> Just $ MatchRow (replaceAt col (subPatterns p) ps) bs e
+            _ -> Nothing
+        subPatterns (ConstrPattern _ args) = args
+        subPatterns _ = []
+
+    defaultRows col isHead = [row | row <- rows, not (isHead (column col row))]
+
+    switchConstr col name = do
+        let (occ, tpe) = occs !! col
+            (dataName, _) = ctorDataTag ctx name
+            ctors = fromMaybe Map.empty $ Map.lookup dataName (ctx ^. constructorTags)
+            isHead (ConstrPattern n _) = Map.member n ctors
+            isHead _ = False
+            heads = List.nub [n | ConstrPattern n _ <- map (column col) rows, Map.member n ctors]
+        cases <- forM heads $ \ctorName -> do
+            let constrArgs = constructorArgsOf col ctorName
+                arity = length constrArgs
+                sameCtor (ConstrPattern n _) = n == ctorName
+                sameCtor _ = False
+                specialized = specialize col occ arity sameCtor
+            names <- forM constrArgs $ \_ -> freshName "$match"
+            let subOccs = [(Ident (metaType t) n, t) | (n, Arg _ t) <- zip names constrArgs]
+            tree <- compileMatch ctx resultType (replaceAt col subOccs occs) specialized
+            let isUsed i = any (\row -> case column (col + i) row of WildcardPattern -> False; _ -> True) specialized
+                loadField (i, n, Arg field t) acc
+                    | isUsed i = Let False (metaType resultType) n TypeAny (Select (metaType t) occ (Ident (metaType $ tpe ==> t) field)) acc
+                    | otherwise = acc
+            let tag = fromMaybe (error "ctorTag") $ Map.lookup ctorName ctors
+            return (tag, foldr loadField tree (zip3 [0..] names constrArgs))
+        -- in static mode the value is known to be of this data type, so a full set of constructors needs no default
+        dflt <- if isStaticMode ctx && length heads == Map.size ctors
+                then return $ genFail ctx resultType
+                else compileMatch ctx resultType occs (defaultRows col isHead)
+        let dataTag = Ident (metaType $ tpe ==> TypeInt ==> TypeInt) (NS "Prelude" "runtimeDataTag")
+            typeId = Literal (metaType TypeInt) (IntLit (dataTypeId ctx dataName))
+            scrutinee = Apply (metaType TypeInt) dataTag [occ, typeId]
+        return $ Switch (metaType resultType) scrutinee cases dflt
+
+    switchInt col = do
+        let (occ, tpe) = occs !! col
+            isHead (LitPattern (IntLit n)) = isSwitchable n
+            isHead _ = False
+            heads = List.nub [n | LitPattern (IntLit n) <- map (column col) rows, isSwitchable n]
+        cases <- forM heads $ \n -> do
+            tree <- compileMatch ctx resultType (removeAt col occs) (specialize col occ 0 (== LitPattern (IntLit n)))
+            return (n, tree)
+        dflt <- compileMatch ctx resultType occs (defaultRows col isHead)
+        return $ Switch (metaType resultType) occ cases dflt
+
+    -- dynamic mode switches only on immediate Ints, any other value goes to the default branch
+    isSwitchable n = isStaticMode ctx || (n >= -(2 ^ 31) && n < 2 ^ 31)
+
+    ifLit col literal = do
+        let (occ, tpe) = occs !! col
+            isHead p = p == LitPattern literal
+            eqFun = Ident (metaType $ tpe ==> tpe ==> TypeBool) "=="
+            applyEq = Apply (metaType TypeBool) eqFun [occ, Literal (metaType tpe) literal]
+        tr <- compileMatch ctx resultType (removeAt col occs) (specialize col occ 0 isHead)
+        fl <- compileMatch ctx resultType occs (defaultRows col isHead)
+        return $ If (metaType resultType) applyEq tr fl
+
+    constructorArgsOf col ctorName = case Map.lookup ctorName (ctx ^. constructorArgs) of
+        Just constrArgs -> case [args | ConstrPattern n args <- map (column col) rows, n == ctorName, length args /= length constrArgs] of
+            [] -> constrArgs
+            args : _ -> error $ printf "Constructor %s has %d parameters, but %d given"
+                (show ctorName) (length constrArgs) (length args) -- TODO box this error
+        Nothing -> error $ printf "Unknown constructor %s" (show ctorName)
+
+    removeAt i xs = let (before, after) = splitAt i xs in before ++ drop 1 after
+    replaceAt i ys xs = let (before, after) = splitAt i xs in before ++ ys ++ drop 1 after
+
+ctorDataTag ctx ctorName = case [(dataName, tag) | (dataName, ctors) <- Map.toList (ctx ^. constructorTags), Just tag <- [Map.lookup ctorName ctors]] of
+    [dataTag] -> dataTag
+    _ -> error $ printf "Unknown constructor %s" (show ctorName)
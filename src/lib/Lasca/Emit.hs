@@ -49,14 +49,15 @@ genExternalFuncWrapper ctx other = error $ "genExternalFuncWrapper got " ++ (sho
 
 
 collectGlobals ctx exprs = do
-    execState (mapM toplevel exprs) ctx
+    let globals = execState (mapM toplevel exprs) ctx
+    globals & fieldSymbolIds .~ collectFieldSymbolIds globals
   where
     toplevel expr = case expr of
         Let False meta name _ expr EmptyExpr -> globalVals %= Map.insert name expr
         Let True meta name _ lam EmptyExpr -> globalFunctions %= Map.insert name expr
         _ -> return ()
 
-codegenTop ctx cgen topExpr = case topExpr of
+codegenTop ctx cgenBody topExpr = case topExpr of
     this@(Let False meta name _ expr _) -> do
         modify (\s -> s { _globalValsInit = _globalValsInit s ++ [(name, expr)] })
         let valType = llvmTypeOf this
@@ -68,13 +69,12 @@ codegenTop ctx cgen topExpr = case topExpr of
             let (Literal _ (StringLit externName)) = body
             external (externalTypeMapping tpe) (textToSBS externName) (externArgsToSig args) False []
             genExternalFuncWrapper ctx f
-        else do
-            modState <- get
-            let codeGenResult = codeGen modState
-            let blocks = createBlocks codeGenResult
-            mapM_ defineStringLit (generatedStrings codeGenResult)
-            let retType = mappedReturnType args funcType
-            define retType (nameToSBS name) largs blocks
+        else case EmitStatic.workerSignature f of
+            Just sig | isStaticMode ctx -> do
+                defineFunc (workerCodeGen sig) (externalTypeMapping (snd sig)) (EmitStatic.workerName name)
+                    [(nameToSBS n, externalTypeMapping t) | (Arg n _, t) <- zip args (fst sig)]
+                defineFunc (wrapperCodeGen sig) (mappedReturnType args funcType) (nameToSBS name) largs
+            _ -> defineFunc codeGen (mappedReturnType args funcType) (nameToSBS name) largs
       where
         (args, body) = uncurryLambda lam
 
@@ -92,12 +92,42 @@ codegenTop ctx cgen topExpr = case topExpr of
       --      Debug.traceM $ printf "argsWithTypes %s" (show argsWithTypes)
             entry <- addBlock entryBlockName
             setBlock entry
+            modify (\s -> s { functionName = nameToSBS name, functionType = Just (funcLLvmType f) })
             forM_ argsWithTypes $ \(n, t) -> do
                 var <- alloca t
                 store var (local t (nameToSBS n))
         --        Debug.traceM $ printf "assign %s: %s = %s" n (show t) (show var)
                 assign n var
-            cgen ctx body >>= ret
+            cgenBody ctx body
+
+        defineFunc gen retType fname fargs = do
+            modState <- get
+            let codeGenResult = gen modState
+            let blocks = createBlocks codeGenResult
+            mapM_ defineStringLit (generatedStrings codeGenResult)
+            defineGeneratedGlobals codeGenResult
+            define retType fname fargs blocks
+
+        -- the function body with raw primitive arguments and result
+        workerCodeGen sig@(argTypes, retType) modState = execCodegen [] modState $ do
+            entry <- addBlock entryBlockName
+            setBlock entry
+            modify (\s -> s { functionName = nameToSBS name, functionType = Just (EmitStatic.workerFuncType sig) })
+            forM_ (zip args argTypes) $ \(Arg n _, t) -> do
+                let llvmType = externalTypeMapping t
+                var <- alloca llvmType
+                store var (local llvmType (nameToSBS n))
+                if isPrimitiveType t then assignUnboxed n t var else assign n var
+            EmitStatic.cgenTail ctx (EmitStatic.cgenUnboxed ctx retType) body
+
+        -- boxed entry point: unboxes arguments, calls the worker and boxes its result
+        wrapperCodeGen sig@(argTypes, retType) modState = execCodegen [] modState $ do
+            entry <- addBlock entryBlockName
+            setBlock entry
+            largs <- forM (zip args argTypes) $ \(Arg n _, t) ->
+                EmitStatic.resolveBoxing EmitStatic.anyTypeVar t (localPtr (nameToSBS n))
+            res <- call (EmitStatic.workerFuncType sig) (EmitStatic.workerName name) largs
+            EmitStatic.resolveBoxing retType EmitStatic.anyTypeVar res >>= ret
 
     (Data _ name tvars constructors) -> return ()
     Module{} -> return ()
@@ -133,6 +133,10 @@ defineStringConstants expr = case expr of
         defineStringConstants true
         defineStringConstants false
         return ()
+    S.Switch _ e cases dflt -> do
+        defineStringConstants e
+        mapM_ (defineStringConstants . snd) cases
+        defineStringConstants dflt
     S.Select _ lhs rhs -> do
         defineStringConstants lhs
         defineStringConstants rhs
@@ -176,40 +180,151 @@ sizeOfType tpe = do
 
 gcMalloc size = callBuiltin "gcMalloc" [size]
 
-gcMallocType tpe = do
-    size <- sizeOfType tpe
-    ptr <- gcMalloc size
-    casted <- bitcast ptr (T.ptr tpe)
-    return (ptr, casted)
+{-
+    Small objects are popped inline from the runtime's free list of their size class,
+    an empty list is refilled out of line by gcMallocRefill. See gcMalloc in runtime.c.
+-}
+gcMallocType tpe
+    | sizeClass <= smallObjectClasses = do
+        listAddr <- getelementptr (globalOp freeListsType "LASCA_FREE_LISTS") [constIntOp 0, constIntOp sizeClass]
+        fast <- addBlock "alloc.fast"
+        slow <- addBlock "alloc.slow"
+        exit <- addBlock "alloc.exit"
+        obj <- load listAddr
+        isEmpty <- instrTyped T.i1 (I.ICmp IP.EQ obj constNullPtrOp [])
+        cbr isEmpty slow fast
+        -- the next object is linked through the first word, which is cleared then
+        setBlock fast
+        linkAddr <- bitcast obj (T.ptr ptrType)
+        next <- load linkAddr
+        store listAddr next
+        store linkAddr constNullPtrOp
+        br exit
+        fastEnd <- getBlock
+        setBlock slow
+        refilled <- callBuiltin "gcMallocRefill" [constIntOp sizeClass]
+        br exit
+        slowEnd <- getBlock
+        setBlock exit
+        ptr <- phi ptrType [(obj, fastEnd), (refilled, slowEnd)]
+        casted <- bitcast ptr (T.ptr tpe)
+        return (ptr, casted)
+    | otherwise = do
+        size <- sizeOfType tpe
+        ptr <- gcMalloc size
+        casted <- bitcast ptr (T.ptr tpe)
+        return (ptr, casted)
+  where sizeClass = (fst (typeSizeAndAlign tpe) + granuleBytes - 1) `div` granuleBytes
+
+{-
+    Data values are allocated by the kinds of their fields: with only boxed fields as regular GC objects,
+    without boxed fields as pointer free, and otherwise with a GC descriptor of the constructor,
+    so that only the boxed fields are traced. See gcMallocData in runtime.c
+-}
+gcMallocDataValue ctx typeId tag fieldTypes
+    | not (any (isRawField ctx) fieldTypes) = gcMallocType tpe
+    | all (isRawField ctx) fieldTypes = allocate "gcMallocAtomic" []
+    | otherwise = allocate "gcMallocData" [constInt32Op typeId, constInt32Op tag]
+  where
+    tpe = dataValueStructType (length fieldTypes)
+    allocate fn args = do
+        ptr <- callBuiltin fn (args ++ [constIntOp (fst (typeSizeAndAlign tpe))])
+        casted <- bitcast ptr (T.ptr tpe)
+        return (ptr, casted)
+
+-- Keep in sync with GRANULE_BYTES and SMALL_OBJECT_CLASSES in lasca.h
+granuleBytes, smallObjectClasses :: Int
+granuleBytes = 16
+smallObjectClasses = 16
+
+freeListsType = T.ArrayType (fromIntegral smallObjectClasses + 1) ptrType
 
--- takes second field of boxed Int, Byte, Bool, Float, i.e. its value
+-- takes second field of boxed Int, Float, i.e. its value
 unboxDirect expr boxedType = do
     boxed <- bitcast expr (T.ptr boxedType)
     unboxedAddr <- getelementptr boxed [constIntOp 0, constInt32Op 1]
     load unboxedAddr
 {-# INLINE unboxDirect #-}
 
-unboxByte expr = unboxDirect expr boxedByteType
-
-unboxBool expr = unboxDirect expr boxedBoolType
-
-unboxInt expr = unboxDirect expr boxedIntType
+{-
+  Tagged immediate values, see lasca.h.
+  Ints that fit into 63 bits are encoded as (value << 1) | 1.
+  Bool, Byte, Int16 and Int32 are always encoded as (value << 32) | (kind << 2) | 2.
+-}
+immediateIntTag, immediateTag, immediateValueShift :: Int
+immediateIntTag = 1
+immediateTag = 2
+immediateValueShift = 32
+immediateIntMin = -(2 ^ 62) :: Integer
+immediateIntMax = 2 ^ 62 - 1 :: Integer
+
+-- Keep in sync with IMMEDIATE_* kinds in lasca.h
+immediateKind :: Type -> Int
+immediateKind tpe = case tpe of
+    TypeBool  -> 0
+    TypeByte  -> 1
+    TypeInt16 -> 2
+    TypeInt32 -> 3
+    _ -> error $ "immediateKind: unsupported type " ++ show tpe
+
+immediateConst :: Type -> Integer -> C.Constant
+immediateConst TypeInt n = C.IntToPtr (C.Int 64 ((n * 2 + toInteger immediateIntTag) `mod` 2 ^ 64)) ptrType
+immediateConst tpe n = C.IntToPtr (C.Int 64 bits) ptrType
+  where bits = (n `mod` 2 ^ 32) * 2 ^ immediateValueShift + toInteger (immediateKind tpe * 4 + immediateTag)
+
+boxImmediate tpe v = do
+    wide <- instrTyped intType (I.SExt v intType [])
+    shifted <- instrTyped intType (I.Shl False False wide (constIntOp immediateValueShift) [])
+    tagged <- instrTyped intType (I.Or shifted (constIntOp (immediateKind tpe * 4 + immediateTag)) [])
+    inttoptr tagged
+
+unboxImmediate llvmType expr = do
+    bits <- ptrtoint expr intType
+    value <- instrTyped intType (I.AShr False bits (constIntOp immediateValueShift) [])
+    instrTyped llvmType (I.Trunc value llvmType [])
+
+unboxByte expr = unboxImmediate T.i8 expr
+
+unboxBool expr = unboxImmediate boolType expr
+
+-- Int is either immediate or, if it doesn't fit into 63 bits, a heap allocated box
+unboxInt expr = do
+    bits <- ptrtoint expr intType
+    tag <- instrTyped intType (I.And bits (constIntOp immediateIntTag) [])
+    isImmediate <- instrTyped T.i1 (I.ICmp IP.NE tag (constIntOp 0) [])
+    immediate <- addBlock "unbox.immediate"
+    heap <- addBlock "unbox.heap"
+    exit <- addBlock "unbox.exit"
+    cbr isImmediate immediate heap
+    setBlock immediate
+    immValue <- instrTyped intType (I.AShr False bits (constIntOp 1) [])
+    br exit
+    setBlock heap
+    heapValue <- unboxDirect expr boxedIntType
+    br exit
+    setBlock exit
+    instrTyped intType (I.Phi intType [(immValue, immediate), (heapValue, heap)] [])
 {-# INLINE unboxInt #-}
 
 unboxInt16 :: AST.Operand -> Codegen AST.Operand
-unboxInt16 expr = unboxDirect expr boxedInt16Type
+unboxInt16 expr = unboxImmediate T.i16 expr
 
 unboxInt32 :: AST.Operand -> Codegen AST.Operand
-unboxInt32 expr = unboxDirect expr boxedInt32Type
+unboxInt32 expr = unboxImmediate T.i32 expr
 
 unboxFloat64 expr = unboxDirect expr boxedFloatType
 {-# INLINE unboxFloat64 #-}
 
-boxByte v = callBuiltin "boxByte" [v]
-boxBool v = callBuiltin "boxBool" [v] -- todo change to i1
-boxInt v = callBuiltin "boxInt" [v]
-boxInt16 v = callBuiltin "boxInt16" [v]
-boxInt32 v = callBuiltin "boxInt32" [v]
+boxByte v = boxImmediate TypeByte v
+boxBool v = boxImmediate TypeBool v -- todo change to i1
+boxInt v = do
+    shifted <- instrTyped intType (I.Shl False False v (constIntOp 1) [])
+    restored <- instrTyped intType (I.AShr False shifted (constIntOp 1) [])
+    fits <- instrTyped T.i1 (I.ICmp IP.EQ restored v [])
+    tagged <- instrTyped intType (I.Or shifted (constIntOp immediateIntTag) [])
+    cgenIf ptrType (return fits) (inttoptr tagged) (callBuiltin "boxInt" [v])
+boxInt16 v = boxImmediate TypeInt16 v
+boxInt32 v = boxImmediate TypeInt32 v
 boxFloat64 v = callBuiltin "boxFloat64" [v]
 unbox t v = callBuiltin "unbox" [t, v]
 unboxBoolDynamically v = do
@@ -219,8 +334,10 @@ unboxBoolDynamically v = do
 
 
 
-boxLit (S.BoolLit b) meta = boxBool (constOp $ constByte (boolToInt b))
-boxLit (S.IntLit  n) meta = boxInt (constIntOp n)
+boxLit (S.BoolLit b) meta = return $ constOp $ immediateConst TypeBool (boolToInt b)
+boxLit (S.IntLit  n) meta
+    | toInteger n >= immediateIntMin && toInteger n <= immediateIntMax = return $ constOp $ immediateConst TypeInt (toInteger n)
+    | otherwise = boxInt (constIntOp n)
 boxLit (S.FloatLit  n) meta = boxFloat64 (constFloatOp n)
 boxLit S.UnitLit meta = return $ constOp $ constRef ptrType "UNIT_SINGLETON"
 boxLit (S.StringLit s) meta = return $ constOp $ globalStringRefAsPtr s
@@ -240,23 +357,120 @@ showSyms = show . map fst
 
 boxClosure :: Name -> Map Name Int -> [S.Arg] -> Codegen AST.Operand
 boxClosure name mapping enclosedVars = do
+    (idx, argc, sargsPtr) <- closureArgs name mapping enclosedVars
+    callBuiltin "boxClosure" [idx, argc, sargsPtr]
+
+-- Closure that doesn't escape its function is allocated in its frame, see stackAllocPhase
+stackClosure :: Name -> Map Name Int -> [S.Arg] -> Codegen AST.Operand
+stackClosure name mapping enclosedVars = do
+    let structType = closureStructTypeOf (length enclosedVars)
+    closurePtr <- allocaTyped (T.ptr structType) structType Nothing
+    (idx, argc, sargsPtr) <- closureArgs name mapping enclosedVars
+    ptr <- bitcast closurePtr ptrType
+    callBuiltin "initClosure" [ptr, idx, argc, sargsPtr]
+
+-- Function index, enclosed values count and a stack array of enclosed values
+closureArgs name mapping enclosedVars = do
     syms <- gets symtab
     let idx = fromMaybe (error $ printf "No such function %s in mapping %s" (show name) (show mapping)) (Map.lookup name mapping)
     let argc = length enclosedVars
     let findArg n = fromMaybe (error ("Couldn't find " ++ show n ++ " variable in symbols " ++ showSyms syms)) (lookup n syms)
-    let args = map (\(S.Arg n _) -> findArg n) enclosedVars
-    sargsPtr <- gcMalloc (constIntOp $ ptrSize * argc)
-    sargsPtr1 <- bitcast sargsPtr (T.ptr ptrType)
-    let asdf (idx, arg) = do
-            p <- getelementptr sargsPtr1 [idx]
-            bc1 <- bitcast p (T.ptr ptrType)
-            bc <- load arg
-            store bc1 bc
-
-    let sargs = sargsPtr
-    sequence_ [asdf (constIntOp i, a) | (i, a) <- zip [0 .. argc] args]
-    callBuiltin "boxClosure" [constIntOp idx, constIntOp argc, sargsPtr]
-
+    let args = map (\(S.Arg n _) -> (n, findArg n)) enclosedVars
+    -- enclosed values are copied into the closure, so a stack array is enough here
+    sargsPtr <- if argc == 0 then return constNullPtrOp else do
+        argsPtr <- allocaSize ptrType (constIntOp argc)
+        forM_ (zip [0 ..] args) $ \(i, (n, arg)) -> do
+            p <- getelementptr argsPtr [constIntOp i]
+            bc <- loadLocal n arg
+            store p bc
+        bitcast argsPtr ptrType
+    return (constIntOp idx, constIntOp argc, sargsPtr)
+
+{-
+    Known arity call of a flat closure through its code pointer.
+    Enclosed values go first, followed by the call arguments, like in runtimeApply.
+    Closures of another arity or with more than directCallMaxEnclosed enclosed values
+    go through runtimeApply, which reports the errors.
+    Keep in sync with Closure in lasca.h
+-}
+directCallMaxEnclosed :: Int
+directCallMaxEnclosed = 2
+
+cgenCallClosure meta closure largs = do
+    let argc = length largs
+    callBlocks <- forM [0 .. directCallMaxEnclosed] $ \_ -> addBlock "closure.call"
+    slow <- addBlock "closure.slow"
+    exit <- addBlock "closure.exit"
+    closurePtr <- bitcast closure (T.ptr closureStructType)
+    let loadField tpe i = do
+            addr <- getelementptr closurePtr [constIntOp 0, constInt32Op i]
+            instrTyped tpe (I.Load False addr Nothing 0 [])
+    funcPtr <- loadField ptrType 2
+    arity <- loadField intType 3
+    enclosedArgc <- loadField intType 4
+    -- the function must take exactly the enclosed values and the call arguments
+    expectedArgc <- instrTyped intType (I.Sub False False arity (constIntOp argc) [])
+    sameArity <- instrTyped T.i1 (I.ICmp IP.EQ expectedArgc enclosedArgc [])
+    target <- instrTyped intType (I.Select sameArity enclosedArgc (constIntOp (-1)) [])
+    let cases = [(constInt k, block) | (k, block) <- zip [0..] callBlocks]
+    terminator $ I.Do $ I.Switch target slow cases []
+
+    results <- forM (zip [0..] callBlocks) $ \(k, block) -> do
+        setBlock block
+        enclosed <- forM [0 .. k - 1] $ \j -> do
+            p <- getelementptr closurePtr [constIntOp 0, constInt32Op 5, constIntOp j]
+            load p
+        let ftype = funcType ptrType (replicate (k + argc) ptrType)
+        fn <- bitcast funcPtr (T.ptr ftype)
+        res <- callOperand ftype fn (enclosed ++ largs)
+        br exit
+        return (res, block)
+
+    setBlock slow
+    slowResult <- cgenRuntimeApply meta closure largs
+    br exit
+    slow <- getBlock
+
+    setBlock exit
+    phi ptrType ((slowResult, slow) : results)
+
+cgenRuntimeApply meta closure largs = do
+    let argc = constIntOp (length largs)
+    sargsPtr <- allocaSize ptrType argc
+    -- cdecl calling convension, arguments passed right to left
+    forM_ (zip [0..] largs) $ \(i, arg) -> do
+        p <- getelementptr sargsPtr [constIntOp i]
+        store p arg
+    sargs <- bitcast sargsPtr ptrType -- runtimeApply accepts i8*, so need to bitcast. Remove when possible
+    let pos = createPosition $ S.pos meta
+    callBuiltin "runtimeApply" [closure, argc, sargs, constOp pos]
+
+-- Loads a local as a Box*, boxing it if the local holds a raw primitive value
+loadLocal name ptr = do
+    unboxed <- gets unboxedLocals
+    case Map.lookup name unboxed of
+        Just tpe -> loadUnboxed tpe ptr >>= boxPrimitive tpe
+        Nothing -> load ptr
+
+loadUnboxed tpe ptr = instrTyped (externalTypeMapping tpe) (I.Load False ptr Nothing 0 [])
+
+boxPrimitive tpe v = case tpe of
+    TypeBool  -> boxBool v
+    TypeByte  -> boxByte v
+    TypeInt   -> boxInt v
+    TypeInt16 -> boxInt16 v
+    TypeInt32 -> boxInt32 v
+    TypeFloat -> boxFloat64 v
+    _ -> error $ printf "boxPrimitive: %s is not a primitive type" (show tpe)
+
+unboxPrimitive tpe v = case tpe of
+    TypeBool  -> unboxBool v
+    TypeByte  -> unboxByte v
+    TypeInt   -> unboxInt v
+    TypeInt16 -> unboxInt16 v
+    TypeInt32 -> unboxInt32 v
+    TypeFloat -> unboxFloat64 v
+    _ -> error $ printf "unboxPrimitive: %s is not a primitive type" (show tpe)
 
 boolToInt True = 1
 boolToInt False = 0
@@ -279,8 +493,12 @@ builtinConsts =
 builtinFuncs = do
   let external resType name params vararg attrs = (name, (resType, params, vararg, attrs))
   Map.fromList $
-    [ external T.void  "initLascaRuntime" [("runtime", ptrType)] False []
+    [ external intType "initLascaRuntime" [("runtime", ptrType), ("argc", intType), ("argv", ptrType)] False []
     , external ptrType "gcMalloc" [("size", intType)] False []
+    , external ptrType "gcMallocRefill" [("sizeClass", intType)] False []
+    , external ptrType "gcMallocAtomic" [("size", intType)] False []
+    , external T.void "gcWriteBarrier" [("obj", ptrType), ("slot", ptrType)] False []
+    , external ptrType "gcMallocData" [("typeId", T.i32), ("tag", T.i32), ("size", intType)] False []
     , external ptrType "unbox" [("t", ptrType), ("ptr", ptrType)] False [FA.GroupID 0]
     , external ptrType "boxError" [("n", ptrType)] False [FA.GroupID 0]
     , external ptrType "boxByte" [("d", T.i8)] False [FA.GroupID 0]
@@ -289,17 +507,21 @@ builtinFuncs = do
     , external ptrType "boxInt32" [("d", T.i32)] False [FA.GroupID 0]
     , external ptrType "boxBool" [("d", boolType)] False [FA.GroupID 0]
     , external ptrType "boxClosure" [("id", intType), ("argc", intType), ("argv", ptrType)] False []
+    , external ptrType "initClosure" [("closure", ptrType), ("id", intType), ("argc", intType), ("argv", ptrType)] False []
     , external ptrType "boxFloat64" [("d", T.double)] False [FA.GroupID 0]
     , external ptrType "boxArray" [("size", intType)] True [FA.GroupID 0]
     , external ptrType "runtimeBinOp"  [("code",  intType), ("lhs",  ptrType), ("rhs", ptrType)] False [FA.GroupID 0]
     , external ptrType "runtimeUnaryOp"  [("code",  intType), ("expr",  ptrType)] False [FA.GroupID 0]
     , external ptrType "runtimeApply"  [("func", ptrType), ("argc", intType), ("argv", ptrType), ("pos", positionStructType)] False []
     , external ptrType "runtimeSelect" [("tree", ptrType), ("expr", ptrType), ("pos", positionStructType)] False [FA.GroupID 0]
+    , external ptrType "runtimeSelectField" [("cache", ptrType), ("tree", ptrType), ("fieldId", intType), ("name", ptrType), ("pos", positionStructType)] False []
     , external T.void  "initEnvironment" [("argc", intType), ("argv", ptrType)] False []
     ]
 
 declareStdFuncs = do
     forM_ builtinConsts (externalConst ptrType) -- declare constants
+    externalGlobal freeListsType "LASCA_FREE_LISTS"
+    externalGlobal boolType "LASCA_WRITE_BARRIER"
     forM (Map.toList builtinFuncs) $ \(name, args) -> do
         let (restype, params, vararg, attrs) = args
         external restype name params vararg attrs
@@ -371,12 +593,79 @@ genFunctionMap fns = do
             (name, name, (funcLLvmType f), length args) : s
         go s _ = s
 
-genRuntime opts fmt tst = defineConst "Runtime" runtimeStructType runtime
+genRuntime opts fmt tst syms = defineConst "Runtime" runtimeStructType runtime
   where
-    runtime = createStruct [constRef fmt "Functions", constRef tst "Types", constBool $ Opts.verboseMode opts]
-
-genTypeStruct :: Name -> LLVM C.Constant
-genTypeStruct name = do
+    runtime = createStruct [constRef fmt "Functions", constRef tst "Types", constRef syms "Symbols", constBool $ Opts.verboseMode opts]
+
+{-
+  Compile time symbol ids of data type field names.
+  Runtime metadata of every constructor has its field ids, see Struct in lasca.h,
+  so dynamic mode field selection compares integers instead of names.
+  The ids are the ids of the field name Symbols, see genSymbols.
+  Computed once per module by collectGlobals, use S._fieldSymbolIds.
+-}
+collectFieldSymbolIds :: Ctx -> Map Name Int
+collectFieldSymbolIds ctx = Map.fromList $ zip (Set.toList fieldNames) [0..]
+  where fieldNames = Set.fromList $ concatMap Map.keys $ Map.elems $ S._dataDefsFields ctx
+
+{-
+  Symbols interned at compile time: field names with their S._fieldSymbolIds, then String.intern literals.
+  They are mutable globals: the runtime sets their hashes and adds them to its intern table,
+  so String.intern of the same name at runtime returns the same object. See initSymbols in runtime.c
+-}
+genSymbols :: Ctx -> [Text] -> LLVM T.Type
+genSymbols ctx literals = do
+    forM_ symbols $ \(s, symbolId) -> do
+        defineStringLit s
+        defineGlobal (symbolLitName s) symbolStructType (Just $ createStruct [headerConst symbolTypeId 0, constInt 0, constInt symbolId, globalStringRefAsPtr s])
+    defineConst "Symbols" structType (createStruct [constInt len, C.Array ptrType [symbolLitRef s | (s, _) <- symbols]])
+    return structType
+  where
+    fields = [(nameToText name, symbolId) | (name, symbolId) <- List.sortOn snd (Map.toList (S._fieldSymbolIds ctx))]
+    others = Set.toList (Set.fromList literals `Set.difference` Set.fromList (map fst fields))
+    symbols = fields ++ zip others [length fields ..]
+    len = length symbols
+    structType = T.StructureType False [intType, T.ArrayType (fromIntegral len) ptrType]
+
+{-
+  Layout of data value fields, see Struct in lasca.h.
+  In static mode Int, Float, Bool and Byte fields are stored as raw scalars in their DataValue slot.
+  Dynamic mode doesn't know field value types, so every field stays boxed.
+-}
+-- Keep in sync with FIELD_* in lasca.h
+data FieldKind = FieldBoxed | FieldInt | FieldFloat | FieldBool | FieldByte deriving (Show, Eq, Enum)
+
+fieldKind :: Ctx -> Type -> FieldKind
+fieldKind ctx tpe | S.isStaticMode ctx = case tpe of
+    TypeInt   -> FieldInt
+    TypeFloat -> FieldFloat
+    TypeBool  -> FieldBool
+    TypeByte  -> FieldByte
+    _         -> FieldBoxed
+fieldKind ctx tpe = FieldBoxed
+
+isRawField ctx tpe = fieldKind ctx tpe /= FieldBoxed
+
+-- Address of field slot idx of a data value
+dataFieldAddr value idx = do
+    dataValue <- bitcast value (T.ptr (dataValueStructType 0))
+    getelementptr dataValue [constIntOp 0, constInt32Op 2, constIntOp idx]
+
+-- Raw value of a raw field, or Box* of a boxed one
+loadDataField ctx tpe value idx = do
+    addr <- dataFieldAddr value idx
+    if isRawField ctx tpe then do
+        let llvmType = externalTypeMapping tpe
+        rawAddr <- bitcast addr (T.ptr llvmType)
+        instrTyped llvmType (I.Load False rawAddr Nothing 0 [])
+    else load addr
+
+-- Keep in sync with LATYPE_KIND_* in lasca.h
+data LaTypeKind = LaTypeBuiltin | LaTypeData | LaTypeOpaque deriving (Show, Eq, Enum)
+
+-- dataRef points to the Data descriptor of the type, so the runtime gets it with a single load
+genTypeStruct :: Name -> Int -> LaTypeKind -> C.Constant -> LLVM C.Constant
+genTypeStruct name typeId kind dataRef = do
     let nm = nameToText name
     let sbsName = textToSBS nm
     let literalName = nm `T.append` ".Literal"
@@ -384,7 +673,8 @@ genTypeStruct name = do
     let typeName = nm `T.append` "_LaType"
     let sbsTypeName = textToSBS typeName
     let (charArray, len) = createCString nm
-    let laTypeStruct = createStruct [constRef (T.ArrayType (fromIntegral len) T.i8) sbsLiteralName]
+    let laTypeStruct = createStruct [constRef (T.ArrayType (fromIntegral len) T.i8) sbsLiteralName,
+                                     constInt32 typeId, constInt32 (fromEnum kind), dataRef]
     defineConst sbsLiteralName (T.ArrayType (fromIntegral len) T.i8) charArray
     defineConst sbsTypeName laTypeStructType laTypeStruct
     return $ constRef laTypeStructType sbsTypeName
@@ -392,29 +682,31 @@ genTypeStruct name = do
 --genData :: Ctx -> [S.Expr] -> ([S.Arg] -> [(SBS.ShortByteString, AST.Type)]) -> LLVM ([C.Constant])
 genData ctx defs argsToSig argToPtr = sequence [genDataStruct d | d <- defs]
   where genDataStruct dd@(S.Data meta name tvars constrs) = do
-            typePtr <- genTypeStruct name
-            defineStringLit (nameToText name)
+            let typeId = dataTypeId ctx name
+            let kind = if null constrs then LaTypeOpaque else LaTypeData
             let literalName = fromString $ "Data." ++ (show name)
             let numConstructors = length constrs
-            constructors <- genConstructors ctx typePtr dd
+            let dataStructType numConstructors = T.StructureType False [
+                      ptrType, ptrType, intType, T.ArrayType (fromIntegral numConstructors) ptrType
+                    ]
+            typePtr <- genTypeStruct name typeId kind (constRef (dataStructType numConstructors) literalName)
+            defineStringLit (nameToText name)
+            constructors <- genConstructors ctx typePtr typeId dd
             let arrayOfConstructors = C.Array ptrType constructors
             let struct = createStruct [typePtr,
                                        globalStringRefAsPtr (nameToText name),
                                        constInt numConstructors,
                                        arrayOfConstructors] -- struct Data
-            let dataStructType numConstructors = T.StructureType False [
-                      ptrType, ptrType, intType, T.ArrayType (fromIntegral numConstructors) ptrType
-                    ]
             defineConst literalName (dataStructType numConstructors) struct
             return (constRef (dataStructType numConstructors) literalName)
         genDataStruct e = error ("genDataStruct should only be called on Data, but called on" ++ show e)
 
-        genConstructors ctx typePtr (S.Data meta name tvars constrs) = do
+        genConstructors ctx typePtr typeId (S.Data meta name tvars constrs) = do
             forM (zip constrs [0..]) $ \ ((S.DataConst n args), tag) ->
-                defineConstructor ctx typePtr name n tag args
-        genConstructors ctx typePtr e = error ("genConstructors should only be called on Data, but called on" ++ show e)
+                defineConstructor ctx typePtr typeId name n tag args
+        genConstructors ctx typePtr typeId e = error ("genConstructors should only be called on Data, but called on" ++ show e)
 
-        defineConstructor ctx typePtr typeName name tag args  = do
+        defineConstructor ctx typePtr typeId typeName name tag args  = do
           -- TODO optimize for zero args
             modState <- get
             let codeGenResult = codeGen typePtr modState
@@ -424,7 +716,7 @@ genData ctx defs argsToSig argToPtr = sequence [genDataStruct d | d <- defs]
             if null args
             then do
                 let singletonName = show name ++ ".Singleton"
-                let dataValue = createStruct [typePtr, constInt tag, C.Array ptrType []]
+                let dataValue = createStruct [constInt32 typeId, constInt32 tag, C.Array ptrType []]
                 defineConst (fromString singletonName) (dataValueStructType len) dataValue
                 let ptrRef = constRef (dataValueStructType len) (fromString singletonName)
                 defineStringLit txtName
@@ -433,8 +725,14 @@ genData ctx defs argsToSig argToPtr = sequence [genDataStruct d | d <- defs]
                 define ptrType sbsName fargs blocks -- define constructor function
                 forM_ args $ \ (S.Arg name _) -> defineStringLit (nameToText name) -- define fields names as strings
 
-            let structType = T.StructureType False [ptrType, ptrType, intType, T.ArrayType (fromIntegral len) ptrType]
-            let struct =  createStruct [typePtr, globalStringRefAsPtr (nameToText name), constInt len, fieldsArray]
+            let fieldIdsType = T.ArrayType (fromIntegral len) intType
+            let fieldIdsName = fromString $ (show typeName) ++ "." ++ show name ++ ".FieldIds"
+            defineConst fieldIdsName fieldIdsType fieldIdsArray
+            let fieldKindsName = fromString $ (show typeName) ++ "." ++ show name ++ ".FieldKinds"
+            defineConst fieldKindsName fieldIdsType fieldKindsArray
+            let structType = T.StructureType False [ptrType, ptrType, ptrType, ptrType, intType, T.ArrayType (fromIntegral len) ptrType]
+            let struct =  createStruct [typePtr, globalStringRefAsPtr (nameToText name), constRef fieldIdsType fieldIdsName,
+                                        constRef fieldIdsType fieldKindsName, constInt len, fieldsArray]
             let literalName = fromString $ (show typeName) ++ "." ++ show name
             defineConst literalName structType struct
 
@@ -445,31 +743,59 @@ genData ctx defs argsToSig argToPtr = sequence [genDataStruct d | d <- defs]
             fargs = argsToSig args
             fieldsArray = C.Array ptrType fields
             fields = map (\(S.Arg n _) -> globalStringRefAsPtr (nameToText n)) args
+            fieldIds = S._fieldSymbolIds ctx
+            fieldIdsArray = C.Array intType [constInt (fieldIds Map.! n) | S.Arg n _ <- args]
+            fieldKindsArray = C.Array intType [constInt (fromEnum $ fieldKind ctx t) | S.Arg _ t <- args]
 
             codeGen typePtr modState = execCodegen [] modState $ do
                 entry <- addBlock entryBlockName
                 setBlock entry
-                (ptr, structPtr) <- gcMallocType (dataValueStructType len)
-                typeAddr <- getelementptr structPtr [constIntOp 0, constInt32Op 0] -- [dereference, 1st field: type] {LaType*, tag, [arg1, arg2 ...]}
-                store typeAddr (constOp typePtr)
-                tagAddr <- getelementptr structPtr [constIntOp 0, constInt32Op 1] -- [dereference, 2nd field: tag] {LaType*, tag, [arg1, arg2 ...]}
-                store tagAddr (constIntOp tag)
-                let argsWithId = zip args [0..]
-                forM_ argsWithId $ \(arg, i) -> do
-                    p <- getelementptr structPtr [constIntOp 0, constInt32Op 2, constIntOp i] -- [dereference, 3rd field, ith element] {LaType*, tag, [arg1, arg2 ...]}
+                (ptr, structPtr) <- gcMallocDataValue ctx typeId tag [tpe | S.Arg _ tpe <- args]
+                values <- forM args $ \arg@(S.Arg _ tpe) -> do
                     ref <- argToPtr arg
-                    store p ref
+                    return (tpe, ref)
+                initDataValue ctx structPtr typeId tag values
                 ret ptr
 
+-- Stores the header and the boxed field values of a data value
+initDataValue ctx structPtr typeId tag fields = do
+    typeAddr <- getelementptr structPtr [constIntOp 0, constInt32Op 0] -- [dereference, 1st field: type id] {typeId, tag, [arg1, arg2 ...]}
+    store typeAddr (constInt32Op typeId)
+    tagAddr <- getelementptr structPtr [constIntOp 0, constInt32Op 1] -- [dereference, 2nd field: tag] {typeId, tag, [arg1, arg2 ...]}
+    store tagAddr (constInt32Op tag)
+    forM_ (zip fields [0..]) $ \((tpe, ref), i) -> do
+        p <- getelementptr structPtr [constIntOp 0, constInt32Op 2, constIntOp i] -- [dereference, 3rd field, ith element] {typeId, tag, [arg1, arg2 ...]}
+        if isRawField ctx tpe then do
+            raw <- unboxPrimitive tpe ref
+            rawPtr <- bitcast p (T.ptr (externalTypeMapping tpe))
+            store rawPtr raw
+        else store p ref
+
+{-
+    Constructor application that doesn't escape its function, see stackAllocPhase.
+    The data value is allocated in the function's frame instead of the GC heap.
+-}
+cgenStackDataValue ctx ctor fieldValues = do
+    let (typeId, tag) = fromMaybe (error $ "Unknown constructor " ++ show ctor) (constructorTypeIdAndTag ctx ctor)
+        fieldTypes = [tpe | S.Arg _ tpe <- fromMaybe [] (Map.lookup ctor (ctx ^. S.constructorArgs))]
+        structType = dataValueStructType (length fieldValues)
+    structPtr <- allocaTyped (T.ptr structType) structType Nothing
+    initDataValue ctx structPtr typeId tag (zip fieldTypes fieldValues)
+    bitcast structPtr ptrType
+
 codegenStartFunc ctx cgen mainName = do
     modState <- get
-    define T.void "main" [("argc", intType), ("argv", ptrType)] (bls modState)
+    let codeGenResult = codeGen modState
+    defineGeneratedGlobals codeGenResult
+    define T.void "main" [("argc", intType), ("argv", ptrType)] (createBlocks codeGenResult)
   where
-    bls modState = createBlocks $ execCodegen [] modState $ do
+    codeGen modState = execCodegen [] modState $ do
         entry <- addBlock entryBlockName
         setBlock entry
-        instrDo $ callFnIns (funcType T.void [ptrType]) "initLascaRuntime" [constOp $ constRef runtimeStructType "Runtime"]
-        instrDo $ callFnIns (funcType T.void [intType, ptrType]) "initEnvironment" [local intType "argc", localPtr "argv"]
+        modify (\s -> s { functionName = "main" })
+        -- initLascaRuntime consumes RTS options from argv and returns the number of program arguments left
+        argc <- callBuiltin "initLascaRuntime" [constOp $ constRef runtimeStructType "Runtime", local intType "argc", localPtr "argv"]
+        instrDo $ callFnIns (funcType T.void [intType, ptrType]) "initEnvironment" [argc, localPtr "argv"]
         initGlobals
         call (funcType ptrType []) (nameToSBS mainName) []
         terminator $ I.Do $ I.Ret Nothing []
@@ -485,6 +811,147 @@ codegenStartFunc ctx cgen mainName = do
         store (globalOp ptrType (fromString (show name))) v
         return v
 
+-- Inlined Prelude.runtimeCheckTag: value is known to be a data value, compare its constructor tag
+cgenCheckTag value tag = do
+    isTag <- checkTag value tag
+    bool <- instrTyped boolType (I.ZExt isTag boolType [])
+    boxBool bool
+
+-- Inlined Prelude.writeVar: like the runtime writeVar, stores the value into the Var cell and returns the old value
+cgenWriteVar var value = do
+    addr <- dataFieldAddr var 0
+    old <- load addr
+    store addr value
+    cgenWriteBarrier var addr
+    return old
+
+{-
+    After a pointer store into the slot of a heap object while an arena is active:
+    keeps the stored value from escaping the arena. See gcWriteBarrier in runtime.c
+-}
+cgenWriteBarrier obj slot = do
+    barrier <- addBlock "barrier"
+    exit <- addBlock "barrier.exit"
+    flag <- load (globalOp boolType "LASCA_WRITE_BARRIER")
+    enabled <- instrTyped T.i1 (I.ICmp IP.NE flag (constOp (constBool False)) [])
+    cbr enabled barrier exit
+    setBlock barrier
+    slotPtr <- bitcast slot ptrType
+    instrDo $ callFnIns (funcType T.void [ptrType, ptrType]) "gcWriteBarrier" [obj, slotPtr]
+    br exit
+    setBlock exit
+
+-- Inlined Prelude.runtimeCheckConstr: compare LaType id and constructor tag of any value
+cgenCheckConstr value typeId tag = do
+    isPointer <- isPointerValue value
+    let false = constOp $ immediateConst TypeBool 0
+        checkTypeAndTag = cgenIf ptrType (checkTypeId value typeId) (cgenCheckTag value tag) (return false)
+    cgenIf ptrType (return isPointer) checkTypeAndTag (return false)
+
+-- Inlined Prelude.runtimeDataTag for a value of unknown type: raw constructor tag, or -1 for values of other types
+cgenDataTag value typeId = do
+    isPointer <- isPointerValue value
+    isData <- addBlock "datatag.check"
+    isType <- addBlock "datatag.load"
+    exit <- addBlock "datatag.exit"
+    entry <- getBlock
+    cbr isPointer isData exit
+    setBlock isData
+    sameType <- checkTypeId value typeId
+    cbr sameType isType exit
+    checked <- getBlock
+    setBlock isType
+    tag <- loadTag value
+    br exit
+    setBlock exit
+    instrTyped intType (I.Phi intType [(constIntOp (-1), entry), (constIntOp (-1), checked), (tag, isType)] [])
+
+isPointerValue value = do
+    bits <- ptrtoint value intType
+    tagBits <- instrTyped intType (I.And bits (constIntOp 3) [])
+    instrTyped T.i1 (I.ICmp IP.EQ tagBits (constIntOp 0) [])
+
+-- the type id is the first field of every heap object header
+checkTypeId value typeId = do
+    dataValue <- bitcast value (T.ptr (dataValueStructType 0))
+    idAddr <- getelementptr dataValue [constIntOp 0, constInt32Op 0]
+    valueTypeId <- instrTyped T.i32 (I.Load False idAddr Nothing 0 [])
+    instrTyped T.i1 (I.ICmp IP.EQ valueTypeId (constInt32Op typeId) [])
+
+checkTag value tag = do
+    valueTag <- loadTag value
+    instrTyped T.i1 (I.ICmp IP.EQ valueTag (constIntOp tag) [])
+
+loadTag value = do
+    dataValue <- bitcast value (T.ptr (dataValueStructType 0))
+    tagAddr <- getelementptr dataValue [constIntOp 0, constInt32Op 1]
+    tag <- instrTyped T.i32 (I.Load False tagAddr Nothing 0 [])
+    instrTyped intType (I.SExt tag intType [])
+
+{-
+    Lowers S.Switch: a jump table on an unboxed Int scrutinee.
+    Branches are code generators returning boxed values.
+-}
+cgenSwitch scrutinee cases dflt = do
+    caseBlocks <- forM cases $ \_ -> addBlock "switch.case"
+    dfltBlock <- addBlock "switch.default"
+    exit <- addBlock "switch.exit"
+    terminator $ I.Do $ I.Switch scrutinee dfltBlock [(constInt tag, block) | ((tag, _), block) <- zip cases caseBlocks] []
+    results <- forM (zip cases caseBlocks) $ \((_, gen), block) -> do
+        setBlock block
+        value <- gen
+        br exit
+        end <- getBlock
+        return (value, end)
+    setBlock dfltBlock
+    dfltValue <- dflt
+    br exit
+    dfltEnd <- getBlock
+    setBlock exit
+    phi ptrType (results ++ [(dfltValue, dfltEnd)])
+
+-- cgenIf and cgenSwitch for tail positions: there is no exit block, every branch returns on its own
+cgenIfTail cond tr fl = do
+    ifthen <- addBlock "if.then"
+    ifelse <- addBlock "if.else"
+    test <- cond
+    cbr test ifthen ifelse
+    setBlock ifthen
+    tr
+    setBlock ifelse
+    fl
+
+cgenSwitchTail scrutinee cases dflt = do
+    caseBlocks <- forM cases $ \_ -> addBlock "switch.case"
+    dfltBlock <- addBlock "switch.default"
+    terminator $ I.Do $ I.Switch scrutinee dfltBlock [(constInt tag, block) | ((tag, _), block) <- zip cases caseBlocks] []
+    forM_ (zip cases caseBlocks) $ \((_, gen), block) -> do
+        setBlock block
+        gen
+    setBlock dfltBlock
+    dflt
+
+{-
+    Lowers Prelude.whileLoop(cond, body) generated by loopsPhase.
+    The condition and the body are generated once, and evaluated on every iteration. The result is Unit.
+-}
+cgenWhile cond body = do
+    loopCond <- addBlock "while.cond"
+    loopBody <- addBlock "while.body"
+    loopExit <- addBlock "while.exit"
+    br loopCond
+
+    setBlock loopCond
+    test <- cond
+    cbr test loopBody loopExit
+
+    setBlock loopBody
+    body
+    br loopCond
+
+    setBlock loopExit
+    boxLit S.UnitLit S.emptyMeta
+
 cgenIf resultType cond tr fl = do
     ifthen <- addBlock "if.then"
     ifelse <- addBlock "if.else"
@@ -511,7 +978,10 @@ cgenIf resultType cond tr fl = do
     -- if.exit
     ------------------
     setBlock ifexit
-    phi resultType [(trval, ifthen), (flval, ifelse)]
+    instrTyped resultType (I.Phi resultType [(trval, ifthen), (flval, ifelse)] [])
+
+defineGeneratedGlobals codeGenResult =
+    forM_ (reverse $ generatedGlobals codeGenResult) $ \(name, tpe, initial) -> defineGlobal name tpe (Just initial)
 
 genTypesStruct ctx defs = do
     types <- genData ctx defs toSig argToPtr
@@ -61,10 +61,7 @@ import qualified Lasca.Options as Opts
 
 cgen :: Ctx -> S.Expr -> Codegen AST.Operand
 cgen ctx (S.Let False meta a _ b c) = do
-    i <- alloca $ llvmTypeOf b
-    val <- cgen ctx b
-    store i val
-    assign a i
+    cgenLet ctx a b
     cgen ctx c
 cgen ctx (S.Ident meta name) = do
     syms <- gets symtab
@@ -87,31 +84,146 @@ cgen ctx this@(S.Select meta tree expr) = cgenSelect ctx this
 
 cgen ctx this@(S.Apply meta (S.Ident _ "unary-") [expr]) = cgenApplyUnOp ctx this
 cgen ctx this@(S.Apply meta (S.Ident _ fn) [lhs, rhs]) | fn `Map.member` binops = cgenApplyBinOp ctx this
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "runtimeCheckConstr")) [value, S.Literal _ (S.IntLit typeId), S.Literal _ (S.IntLit tag)]) = do
+    v <- cgen ctx value
+    cgenCheckConstr v typeId tag
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "whileLoop")) [cond, body]) = cgenWhile (cgenCondDynamic ctx cond) (cgen ctx body)
+-- Assignment of a Var promoted to a local, see promoteVarsPhase
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "assignLocal")) [S.Ident _ name, value]) = do
+    ptr <- getvar name
+    val <- cgen ctx value
+    store ptr val
+    boxLit S.UnitLit meta
+-- interned at compile time, see genSymbols
+cgen ctx (S.Apply meta (S.Ident _ (NS "String" "intern")) [S.Literal _ (S.StringLit s)]) = return $ constOp $ symbolLitRef s
+cgen ctx (S.Apply meta (S.Ident _ ctor) args) | S.isStackAllocated meta = do
+    values <- mapM (cgen ctx) args
+    cgenStackDataValue ctx ctor values
 cgen ctx (S.Apply meta expr args) = cgenApply ctx meta expr args
-cgen ctx (S.Closure _ funcName enclosedVars) = do
+cgen ctx (S.Closure meta funcName enclosedVars) = do
     modState <- gets moduleState
     let mapping = functions modState
-    boxClosure funcName mapping enclosedVars
+    if S.isStackAllocated meta
+    then stackClosure funcName mapping enclosedVars
+    else boxClosure funcName mapping enclosedVars
 cgen ctx m@S.Match{} =
     error $ printf "Match expressions should be already desugared! %s at: %s" (show m) (show $ S.exprPosition m)
 cgen ctx (S.If meta cond tr fl) = cgenIfDynamic ctx meta cond tr fl
+cgen ctx (S.Switch meta scrutinee cases dflt) = do
+    value <- cgenScrutinee ctx scrutinee cases
+    cgenSwitch value [(tag, cgen ctx e) | (tag, e) <- cases] (cgen ctx dflt)
 cgen ctx e = error ("cgen shit " ++ show e)
 
+cgenLet ctx name value = do
+    i <- alloca $ llvmTypeOf value
+    val <- cgen ctx value
+    store i val
+    assign name i
+
+-- Int value to switch on, cases are needed for values that match none of them
+cgenScrutinee ctx scrutinee cases = case scrutinee of
+    S.Apply _ (S.Ident _ (NS "Prelude" "runtimeDataTag")) [v, S.Literal _ (S.IntLit typeId)] -> do
+        v <- cgen ctx v
+        cgenDataTag v typeId
+    _ -> do
+        -- only immediate Ints can match Int literals (see compileMatch),
+        -- any other value is mapped to a number that isn't one of the cases
+        v <- cgen ctx scrutinee
+        bits <- ptrtoint v intType
+        tag <- instrTyped intType (I.And bits (constIntOp immediateIntTag) [])
+        isInt <- instrTyped T.i1 (I.ICmp IP.NE tag (constIntOp 0) [])
+        int <- instrTyped intType (I.AShr False bits (constIntOp 1) [])
+        let noMatch = maximum (0 : map fst cases) + 1
+        instrTyped intType (I.Select isInt int (constIntOp noMatch) [])
+
+-- Function body with calls in tail position marked musttail, see cgenTail in EmitStatic.hs
+cgenBody ctx expr = case expr of
+    S.Let False _ name _ value body -> do
+        cgenLet ctx name value
+        cgenBody ctx body
+    S.If _ cond tr fl -> cgenIfTail (cgenCondDynamic ctx cond) (cgenBody ctx tr) (cgenBody ctx fl)
+    S.Switch _ scrutinee cases dflt -> do
+        value <- cgenScrutinee ctx scrutinee cases
+        cgenSwitchTail value [(tag, cgenBody ctx e) | (tag, e) <- cases] (cgenBody ctx dflt)
+    _ -> do
+        value <- cgen ctx expr
+        retTail value
+        return ()
+
 cgenIfDynamic ctx meta cond tr fl = do
     let resultType = llvmTypeOf tr
-    let test = do
-            cond <- cgen ctx cond
-            -- unbox Bool
-            bool <- unboxBoolDynamically cond
-            instr (I.ICmp IP.EQ bool constTrue [])
-    cgenIf resultType test (cgen ctx tr) (cgen ctx fl)
-
-cgenSelect ctx this@(S.Select meta tree expr) = do
+    cgenIf resultType (cgenCondDynamic ctx cond) (cgen ctx tr) (cgen ctx fl)
+
+cgenCondDynamic ctx cond = do
+    cond <- cgen ctx cond
+    -- unbox Bool
+    bool <- unboxBoolDynamically cond
+    instr (I.ICmp IP.EQ bool constTrue [])
+
+cgenSelect ctx this@(S.Select meta tree (S.Ident _ name)) | Just fieldId <- Map.lookup name (S._fieldSymbolIds ctx) = do
+    syms <- gets symtab
+    -- a local or global with the same name wins, e.g. list.length is a function application
+    let isDefined = isJust (lookup name syms) || name `Map.member` S._globalFunctions ctx || name `Map.member` S._globalVals ctx
+    if isDefined then cgenRuntimeSelect ctx this else do
+        tree <- cgen ctx tree
+        cgenSelectField meta tree name fieldId
+cgenSelect ctx this@S.Select{} = cgenRuntimeSelect ctx this
+cgenSelect ctx e = error ("cgenSelect should only be called on Select, but called on" ++ show e)
+
+cgenRuntimeSelect ctx this@(S.Select meta tree expr) = do
     tree <- cgen ctx tree
     e <- cgen ctx expr
     let pos = createPosition $ S.pos meta
     callBuiltin "runtimeSelect" [tree, e, constOp pos]
-cgenSelect ctx e = error ("cgenSelect should only be called on Select, but called on" ++ show e)
+cgenRuntimeSelect ctx e = error ("cgenRuntimeSelect should only be called on Select, but called on" ++ show e)
+
+{-
+  Data field selection with a select site inline cache.
+  The cache remembers the header (type id and tag) and field slot of the last selected value,
+  so for values of the same type and constructor the field is a guarded load.
+  Misses go through runtimeSelectField, which finds the field by its symbol id and fills the cache.
+  Keep in sync with SelectCacheEntry in lasca.h
+-}
+selectCacheType = T.StructureType False [headerType, intType] -- {header {typeId, tag}, slot}
+
+cgenSelectField meta tree name fieldId = do
+    cache <- generateGlobal "selectCache" selectCacheType (createStruct [headerConst (-1) (-1), constInt 0])
+    checkHeader <- addBlock "select.header"
+    hit <- addBlock "select.hit"
+    miss <- addBlock "select.miss"
+    exit <- addBlock "select.exit"
+    -- immediate values have no fields
+    bits <- ptrtoint tree intType
+    tagBits <- instrTyped intType (I.And bits (constIntOp 3) [])
+    isPointer <- instrTyped T.i1 (I.ICmp IP.EQ tagBits (constIntOp 0) [])
+    cbr isPointer checkHeader miss
+
+    -- type id and tag are compared at once, as a 64 bit header
+    setBlock checkHeader
+    dataValue <- bitcast tree (T.ptr (dataValueStructType 0))
+    headerAddr <- bitcast tree (T.ptr intType)
+    header <- instrTyped intType (I.Load False headerAddr Nothing 0 [])
+    cachedHeaderAddr <- bitcast cache (T.ptr intType)
+    cachedHeader <- instrTyped intType (I.Load False cachedHeaderAddr Nothing 0 [])
+    sameHeader <- instrTyped T.i1 (I.ICmp IP.EQ header cachedHeader [])
+    cbr sameHeader hit miss
+
+    setBlock hit
+    slotAddr <- getelementptr cache [constIntOp 0, constInt32Op 1]
+    slot <- instrTyped intType (I.Load False slotAddr Nothing 0 [])
+    valueAddr <- getelementptr dataValue [constIntOp 0, constInt32Op 2, slot]
+    value <- load valueAddr
+    br exit
+
+    setBlock miss
+    cachePtr <- bitcast cache ptrType
+    let pos = createPosition $ S.pos meta
+    let fieldName = constOp $ globalStringRefAsPtr (nameToText name)
+    missValue <- callBuiltin "runtimeSelectField" [cachePtr, tree, constIntOp fieldId, fieldName, constOp pos]
+    br exit
+
+    setBlock exit
+    phi ptrType [(value, hit), (missValue, miss)]
 
 cgenApplyUnOp ctx this@(S.Apply meta op@(S.Ident _ "unary-") [expr]) = do
     lexpr <- cgen ctx expr
@@ -141,16 +253,16 @@ cgenApply ctx meta expr args = do
             call (funcLLvmType f) (nameToSBS fn) largs
 
         expr -> do
-            modState <- gets moduleState
             e <- cgen ctx expr
             largs <- mapM (cgen ctx) args
-            let argc = constIntOp (length largs)
-            sargsPtr <- allocaSize ptrType argc
-            let asdf (idx, arg) = do
-                  p <- getelementptr sargsPtr [idx]
-                  store p arg
-            sargs <- bitcast sargsPtr ptrType -- runtimeApply accepts i8*, so need to bitcast. Remove when possible
-            -- cdecl calling convension, arguments passed right to left
-            sequence_ [asdf (constIntOp i, a) | (i, a) <- zip [0..] largs]
-            let pos = createPosition $ S.pos meta
-            callBuiltin "runtimeApply" [e, argc, sargs, constOp pos]
+            cgenApplyDynamic meta e largs
+
+{-
+  Closure application. Closures of the call's arity are called directly through their code pointer,
+  everything else, including values that aren't closures, goes through runtimeApply.
+-}
+cgenApplyDynamic meta closure largs = do
+    isPointer <- isPointerValue closure
+    let false = constOp $ C.Int 1 0
+        isClosure = cgenIf T.i1 (return isPointer) (checkTypeId closure closureTypeId) (return false)
+    cgenIf ptrType isClosure (cgenCallClosure meta closure largs) (cgenRuntimeApply meta closure largs)
@@ -74,10 +74,7 @@ anyTypeVar = TVar $ TV "a"
 
 cgen :: Ctx -> S.Expr -> Codegen AST.Operand
 cgen ctx (S.Let False meta a _ b c) = do
-    i <- alloca $ llvmTypeOf b
-    val <- cgen ctx b
-    store i val
-    assign a i
+    cgenLet ctx a b
     cgen ctx c
 cgen ctx (S.Ident meta name) = do
     syms <- gets symtab
@@ -86,7 +83,7 @@ cgen ctx (S.Ident meta name) = do
     case lookup name syms of
         Just x ->
     --       Debug.trace ("Local " ++ show name)
-            load x
+            loadLocal name x
         Nothing | name `Map.member` S._globalFunctions ctx -> boxClosure name mapping []
                 | name `Map.member` S._globalVals ctx -> load (globalOp ptrType (nameToSBS name))
                 | otherwise -> boxError (nameToText name)
@@ -101,10 +98,8 @@ cgen ctx this@(S.Apply meta (S.Ident _ "unary-") [expr]) = cgenApplyUnOp ctx thi
 cgen ctx this@(S.Apply meta (S.Ident _ fn) [lhs, rhs]) | fn `Map.member` binops = cgenApplyBinOp ctx this
 -- TODO Either extend it to other types and generalize or make builtin functions inlineable
 cgen ctx this@(S.Apply meta (S.Ident _ (NS "Bits" fn)) [lhs, rhs]) | fn `elem` ["intAnd", "intOr", "intXor", "intShiftL", "intShiftR"] = do
-    llhs <- cgen ctx lhs
-    lrhs <- cgen ctx rhs
-    a <- unboxInt llhs
-    b <-  unboxInt lrhs
+    a <- cgenUnboxed ctx TypeInt lhs
+    b <- cgenUnboxed ctx TypeInt rhs
     case fn of
         (Name "intAnd") -> instrTyped intType (I.And a b []) >>= boxInt
         (Name "intOr")  -> instrTyped intType (I.Or a b []) >>= boxInt
@@ -113,25 +108,135 @@ cgen ctx this@(S.Apply meta (S.Ident _ (NS "Bits" fn)) [lhs, rhs]) | fn `elem` [
         (Name "intShiftR") -> instrTyped intType (I.AShr False a b []) >>= boxInt
         _ -> error $ printf "Unsupported builtin operation %s" (show $ S.exprPosition this)
 
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "runtimeCheckTag")) [value, S.Literal _ (S.IntLit tag)]) = do
+    v <- cgen ctx value
+    cgenCheckTag v tag
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "whileLoop")) [cond, body]) = cgenWhile (cgenCond ctx cond) (cgen ctx body)
+-- Assignment of a Var promoted to a local, see promoteVarsPhase
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "assignLocal")) [S.Ident _ name, value]) = do
+    ptr <- getvar name
+    unboxed <- gets unboxedLocals
+    val <- case Map.lookup name unboxed of
+        Just tpe -> cgenUnboxed ctx tpe value
+        Nothing -> cgen ctx value
+    store ptr val
+    boxLit S.UnitLit meta
+-- the typer guarantees a Var here, no need for the runtime check
+cgen ctx (S.Apply meta (S.Ident _ (NS "Prelude" "writeVar")) [var, value]) = do
+    v <- cgen ctx var
+    val <- cgen ctx value
+    cgenWriteVar v val
+-- interned at compile time, see genSymbols
+cgen ctx (S.Apply meta (S.Ident _ (NS "String" "intern")) [S.Literal _ (S.StringLit s)]) = return $ constOp $ symbolLitRef s
+cgen ctx (S.Apply meta (S.Ident _ ctor) args) | S.isStackAllocated meta = do
+    values <- mapM (cgen ctx) args
+    cgenStackDataValue ctx ctor values
 cgen ctx (S.Apply meta expr args) = cgenApply ctx meta expr args
-cgen ctx (S.Closure _ funcName enclosedVars) = do
+cgen ctx (S.Closure meta funcName enclosedVars) = do
     modState <- gets moduleState
     let mapping = functions modState
-    boxClosure funcName mapping enclosedVars
+    if S.isStackAllocated meta
+    then stackClosure funcName mapping enclosedVars
+    else boxClosure funcName mapping enclosedVars
 cgen ctx m@S.Match{} =
     error $ printf "Match expressions should be already desugared! %s at: %s" (show m) (show $ S.exprPosition m)
 cgen ctx (S.If meta cond tr fl) = cgenIfStatic ctx meta cond tr fl
+cgen ctx (S.Switch meta scrutinee cases dflt) = do
+    value <- cgenScrutinee ctx scrutinee
+    cgenSwitch value [(tag, cgen ctx e) | (tag, e) <- cases] (cgen ctx dflt)
 
 cgen ctx e = error ("cgen shit " ++ show e)
 
+cgenScrutinee ctx scrutinee = case scrutinee of
+    -- the value is known to be a data value, switch on its constructor tag
+    S.Apply _ (S.Ident _ (NS "Prelude" "runtimeDataTag")) [v, _] -> cgen ctx v >>= loadTag
+    _ -> cgenUnboxed ctx TypeInt scrutinee
+
+-- Function body, see cgenTail
+cgenBody ctx body = cgenTail ctx (cgen ctx) body
+
+{-
+    Generates an expression in tail position of a function. If, switch and let bodies keep
+    their subexpressions in tail position and every branch returns on its own,
+    so that calls in tail position become musttail, see retTail.
+    gen generates returned values: boxed, or raw in workers.
+-}
+cgenTail ctx gen expr = case expr of
+    S.Let False _ name _ value body -> do
+        cgenLet ctx name value
+        cgenTail ctx gen body
+    S.If _ cond tr fl -> cgenIfTail (cgenCond ctx cond) (cgenTail ctx gen tr) (cgenTail ctx gen fl)
+    S.Switch _ scrutinee cases dflt -> do
+        value <- cgenScrutinee ctx scrutinee
+        cgenSwitchTail value [(tag, cgenTail ctx gen e) | (tag, e) <- cases] (cgenTail ctx gen dflt)
+    _ -> do
+        value <- gen expr
+        retTail value
+        return ()
+
 cgenIfStatic ctx meta cond tr fl = do
     let resultType = llvmTypeOf tr
-    let test = do
-            cond <- cgen ctx cond
-            -- unbox Bool
-            bool <- unboxBool cond
-            instr (I.ICmp IP.EQ bool constTrue [])
-    cgenIf resultType test (cgen ctx tr) (cgen ctx fl)
+    cgenIf resultType (cgenCond ctx cond) (cgen ctx tr) (cgen ctx fl)
+
+cgenCond ctx cond = do
+    bool <- cgenUnboxed ctx TypeBool cond
+    instrTyped T.i1 (I.ICmp IP.EQ bool constTrue [])
+
+cgenLet ctx name value
+    | isPrimitiveType tpe = do
+        i <- allocaTyped (T.ptr llvmType) llvmType Nothing
+        val <- cgenUnboxed ctx tpe value
+        store i val
+        assignUnboxed name tpe i
+    | otherwise = do
+        i <- alloca $ llvmTypeOf value
+        val <- cgen ctx value
+        store i val
+        assign name i
+  where tpe = S.typeOf value
+        llvmType = externalTypeMapping tpe
+
+{-
+    Generates a raw value of a primitive type tpe (i64 for Int, double for Float, i8 for Bool etc.)
+    without boxing it first where possible: literals, unboxed locals, arithmetic,
+    if expressions and calls of unboxed workers. Anything else is generated boxed and unboxed.
+-}
+cgenUnboxed :: Ctx -> Type -> S.Expr -> Codegen AST.Operand
+cgenUnboxed ctx tpe expr | not (isPrimitiveType tpe) = cgen ctx expr >>= resolveBoxing anyTypeVar tpe
+cgenUnboxed ctx tpe expr = do
+    syms <- gets symtab
+    unboxed <- gets unboxedLocals
+    let isGlobal fn = (fn `Map.member` S._globalFunctions ctx) && isNothing (lookup fn syms)
+    let exprType = S.typeOf expr
+    case expr of
+        S.Literal _ (S.IntLit n) | tpe == TypeInt -> return $ constIntOp n
+        S.Literal _ (S.FloatLit n) | tpe == TypeFloat -> return $ constFloatOp n
+        S.Literal _ (S.BoolLit b) | tpe == TypeBool -> return $ constOp (constBool b)
+        S.Ident _ name | Just x <- lookup name syms, Map.lookup name unboxed == Just tpe -> loadUnboxed tpe x
+        S.Let False _ name _ value body -> do
+            cgenLet ctx name value
+            cgenUnboxed ctx tpe body
+        S.If _ cond tr fl | exprType == tpe ->
+            cgenIf (externalTypeMapping tpe) (cgenCond ctx cond) (cgenUnboxed ctx tpe tr) (cgenUnboxed ctx tpe fl)
+        S.Apply _ (S.Ident _ "unary-") [_] | exprType == tpe -> cgenUnOpUnboxed ctx expr
+        S.Apply _ (S.Ident _ fn) [lhs, rhs] | fn `Map.member` binops, exprType == tpe, isPrimitiveType (fst $ binOpArgTypes expr) ->
+            cgenBinOpUnboxed ctx expr
+        S.Apply _ (S.Ident _ fn) args
+            | isGlobal fn
+            , Just sig@(argTypes, retType) <- workerSignature (S._globalFunctions ctx Map.! fn)
+            , length args == length argTypes
+            , retType == tpe -> callWorker ctx fn sig args
+        S.Select _ tree (S.Ident _ fieldName)
+            | Just (S.Arg _ fieldType, idx) <- dataTypeField ctx (S.typeOf tree) fieldName
+            , fieldType == tpe
+            , isRawField ctx fieldType -> do
+            value <- cgen ctx tree
+            loadDataField ctx fieldType value idx
+        S.Apply _ (S.Ident _ (NS "Array" "getIndex")) [arrayExpr, indexExpr] | arrayElemType arrayExpr == tpe, isPrimArrayElem tpe -> do
+            array <- cgen ctx arrayExpr
+            idx <- cgenUnboxed ctx TypeInt indexExpr
+            cgenArrayApplyUnboxed tpe array idx
+        _ -> cgen ctx expr >>= resolveBoxing anyTypeVar tpe
 
 cgenSelect ctx this@(S.Select meta tree expr) = do
     --    Debug.traceM $ printf "Selecting! %s" (show this)
@@ -150,11 +255,8 @@ cgenSelect ctx this@(S.Select meta tree expr) = do
            let fieldsWithIndex = (S._dataDefsFields ctx) Map.! tpeName
     --            Debug.traceM $ printf "fieldsWithIndex %s" (show fieldsWithIndex)
            let (S.Arg n declaredFieldType, idx) = fromMaybe (error $ printf "No such field %s in %s" (show fieldName) (show tpeName)) (Map.lookup fieldName fieldsWithIndex)
-           let len = length fieldsWithIndex
-           dataStruct <- bitcast tree (T.ptr (dataValueStructType len))
-           array <- getelementptr dataStruct [constIntOp 0, constInt32Op 2]
-           valueAddr <- getelementptr array [constIntOp 0, constIntOp idx]
-           load valueAddr
+           value <- loadDataField ctx declaredFieldType tree idx
+           if isRawField ctx declaredFieldType then boxPrimitive declaredFieldType value else return value
     --            traceM $ printf "AAAA %s: %s" (show array) (show value)
     --            resultValue <- castBoxedValue declaredFieldType value
     --            Debug.traceM $ printf "Selecting %s: %s" (show tree) (show resultValue)
@@ -168,11 +270,23 @@ cgenSelect ctx this@(S.Select meta tree expr) = do
        _ -> error $ printf "Unsupported select: %s at %s" (show this) (show $ S.pos meta)
 cgenSelect ctx e = error ("cgenSelect should only be called on Select, but called on" ++ show e)
 
+-- Declared field and its slot, when treeType is a data type with this field
+dataTypeField ctx treeType fieldName = case treeType of
+    TypeIdent tpeName -> lookupField tpeName
+    TypeApply (TypeIdent tpeName) _ -> lookupField tpeName
+    _ -> Nothing
+  where lookupField tpeName
+            | dataTypeHasField ctx tpeName fieldName = Map.lookup fieldName (S._dataDefsFields ctx Map.! tpeName)
+            | otherwise = Nothing
+
 cgenApplyUnOp ctx this@(S.Apply meta op@(S.Ident _ "unary-") [expr]) = do
-    lexpr' <- cgen ctx expr
+    r <- cgenUnOpUnboxed ctx this
+    resolveBoxing (S.typeOf this) anyTypeVar r
+cgenApplyUnOp ctx e = error ("cgenApplyUnOp should only be called on Apply, but called on" ++ show e)
+
+cgenUnOpUnboxed ctx this@(S.Apply meta op@(S.Ident _ "unary-") [expr]) = do
     let (TypeFunc realExprType _) = S.typeOf op
-    lexpr <- resolveBoxing anyTypeVar realExprType lexpr'
-    let returnType = S.typeOf this
+    lexpr <- cgenUnboxed ctx realExprType expr
     let tpe = S.typeOf expr
     let minus = fromMaybe (error ("Only Byte | Int | Int16 | Int32 | Float supported but given " ++ show tpe)) (getArithOp 11 tpe)
     let llvmType = externalTypeMapping tpe
@@ -183,9 +297,8 @@ cgenApplyUnOp ctx this@(S.Apply meta op@(S.Ident _ "unary-") [expr]) = do
             TypeInt -> C.Int 64 0
             TypeFloat -> C.Float (F.Double 0.0)
             _ -> error $ printf "%s: Unexpected type in unaryOp - %s" (S.showPosition meta) (show tpe)
-    r <- instrTyped llvmType $ (constOp zero) `minus` lexpr
-    resolveBoxing returnType anyTypeVar r
-cgenApplyUnOp ctx e = error ("cgenApplyUnOp should only be called on Apply, but called on" ++ show e)
+    instrTyped llvmType $ (constOp zero) `minus` lexpr
+cgenUnOpUnboxed ctx e = error ("cgenUnOpUnboxed should only be called on Apply, but called on" ++ show e)
 
 getArithOp code tpe = case (code, tpe) of
     (10, _) | isIntegralType tpe -> Just $ \lhs rhs -> I.Add False False lhs rhs []
@@ -214,35 +327,51 @@ getCmpOp code tpe = case (code, tpe) of
     _ -> Nothing
 
 cgenApplyBinOp ctx this@(S.Apply meta op@(S.Ident _ fn) [lhs, rhs]) = do
-    llhs' <- cgen ctx lhs
-    lrhs' <- cgen ctx rhs
-    let lhsType = S.typeOf lhs
-    let rhsType = S.typeOf rhs
+    let (realLhsType, realRhsType) = binOpArgTypes this
     let returnType = S.typeOf this
---    Debug.traceM $ printf "Doing binop %s with type %s" (show this) (show $ S.typeOf op)
-    let (realLhsType, realRhsType) = case S.typeOf op of
-                TypeFunc realLhsType (TypeFunc realRhsType _) -> (realLhsType, realRhsType)
-                _ -> error ("cgenApplyBinOp: Should not happen: " ++ show this ++ show (S.typeOf op))
-    llhs <- resolveBoxing anyTypeVar realLhsType llhs'
-    lrhs <- resolveBoxing anyTypeVar realRhsType lrhs'
     let code = fromMaybe (error ("Couldn't find binop " ++ show fn)) (Map.lookup fn binops)
---    Debug.traceM $ printf "%s: %s <==> %s: %s, code %s" (show lhsType) (show realLhsType) (show rhsType) (show realRhsType) (show code)
-    let llvmType = externalTypeMapping realLhsType
+    -- interned symbols are equal only if they are the same object
+    let symbolCmp = lookup code [(binops Map.! "==", IP.EQ), (binops Map.! "!=", IP.NE)]
     if isPrimitiveType realLhsType
     then do
-        res <- case code of
-            _ | code >= 10 && code <= 13 -> do
-                let op = fromMaybe (error $ printf "cgenApplyBinOp not defined operation code %d for type %s" code (show realLhsType)) (getArithOp code realLhsType)
-                instrTyped llvmType (llhs `op` lrhs)
-            _ | code >= 42 && code <= 47 -> do
-                let op = fromMaybe (error $ printf "cgenApplyBinOp not defined operation code %d for type %s" code (show realLhsType)) (getCmpOp code realLhsType)
-                r <- instrTyped llvmType (llhs `op` lrhs)
-                instrTyped boolType $ I.ZExt r boolType []
-            c  -> error $ printf "%s: Unsupported binary operation %s, code %s, type %s" (show $ S.exprPosition this) (S.printExprWithType this) (show c) (show realLhsType)
+        res <- cgenBinOpUnboxed ctx this
         resolveBoxing returnType anyTypeVar res
-    else callBuiltin "runtimeBinOp" [constIntOp code, llhs', lrhs']
+    else if realLhsType == TypeSymbol && isJust symbolCmp
+    then do
+        llhs <- cgen ctx lhs
+        lrhs <- cgen ctx rhs
+        r <- instrTyped T.i1 (I.ICmp (fromJust symbolCmp) llhs lrhs [])
+        instrTyped boolType (I.ZExt r boolType []) >>= boxBool
+    else do
+        llhs <- cgen ctx lhs
+        lrhs <- cgen ctx rhs
+        callBuiltin "runtimeBinOp" [constIntOp code, llhs, lrhs]
 cgenApplyBinOp ctx e = error ("cgenApplyBinOp should only be called on Apply, but called on" ++ show e)
 
+binOpArgTypes this@(S.Apply meta op [lhs, rhs]) = case S.typeOf op of
+    TypeFunc realLhsType (TypeFunc realRhsType _) -> (realLhsType, realRhsType)
+    _ -> error ("cgenApplyBinOp: Should not happen: " ++ show this ++ show (S.typeOf op))
+binOpArgTypes e = error ("binOpArgTypes should only be called on Apply, but called on" ++ show e)
+
+-- Raw result of a binary operation on primitive operands: the operand type for arithmetic, Bool for comparisons
+cgenBinOpUnboxed ctx this@(S.Apply meta op@(S.Ident _ fn) [lhs, rhs]) = do
+    let (realLhsType, realRhsType) = binOpArgTypes this
+    llhs <- cgenUnboxed ctx realLhsType lhs
+    lrhs <- cgenUnboxed ctx realRhsType rhs
+    let code = fromMaybe (error ("Couldn't find binop " ++ show fn)) (Map.lookup fn binops)
+--    Debug.traceM $ printf "%s: %s <==> %s, code %s" (show realLhsType) (show realRhsType) (show code)
+    let llvmType = externalTypeMapping realLhsType
+    case code of
+        _ | code >= 10 && code <= 13 -> do
+            let op = fromMaybe (error $ printf "cgenApplyBinOp not defined operation code %d for type %s" code (show realLhsType)) (getArithOp code realLhsType)
+            instrTyped llvmType (llhs `op` lrhs)
+        _ | code >= 42 && code <= 47 -> do
+            let op = fromMaybe (error $ printf "cgenApplyBinOp not defined operation code %d for type %s" code (show realLhsType)) (getCmpOp code realLhsType)
+            r <- instrTyped T.i1 (llhs `op` lrhs)
+            instrTyped boolType $ I.ZExt r boolType []
+        c  -> error $ printf "%s: Unsupported binary operation %s, code %s, type %s" (show $ S.exprPosition this) (S.printExprWithType this) (show c) (show realLhsType)
+cgenBinOpUnboxed ctx e = error ("cgenBinOpUnboxed should only be called on Apply, but called on" ++ show e)
+
 cgenApply ctx meta expr args = do
     syms <- gets symtab
     let symMap = Map.fromList syms
@@ -252,38 +381,129 @@ cgenApply ctx meta expr args = do
         this@(S.Ident meta (NS "Array" "getIndex")) -> do
             let [arrayExpr, indexExpr] = args
             array <- cgen ctx arrayExpr -- should be a pointer to either boxed or unboxed array
-            boxedIdx <- cgen ctx indexExpr
-            idx <- unboxInt boxedIdx
---            callFn (funcType ptrType [ptrType, intType]) "arrayGetIndex" [array, idx]
-            cgenArrayApply array idx
+            idx <- cgenUnboxed ctx TypeInt indexExpr
+            cgenArrayApply (arrayElemType arrayExpr) array idx
+
+        S.Ident _ (NS "Array" "setIndex") | [arrayExpr, indexExpr, valueExpr] <- args, isPrimArrayElem (arrayElemType arrayExpr) -> do
+            let elemType = arrayElemType arrayExpr
+            array <- cgen ctx arrayExpr
+            idx <- cgenUnboxed ctx TypeInt indexExpr
+            value <- cgenUnboxed ctx elemType valueExpr
+            cgenIf ptrType (checkTypeId array (primArrayTypeId elemType))
+                (storeArrayElem elemType array idx value)
+                (boxPrimitive elemType value >>= \v -> call (funcType ptrType [ptrType, intType, ptrType]) "arraySetIndex" [array, idx, v])
+
+        S.Ident _ fn | isGlobal fn, Just fn' <- primArrayConstructor fn (S.typeOf meta) ->
+            cgenApply ctx meta (S.Ident meta fn') args
 
         S.Ident _ fn | isGlobal fn -> do
 --            Debug.traceM $ printf "Calling %s" fn
             let f = S._globalFunctions ctx Map.! fn
-            largs <- forM args $ \arg -> cgen ctx arg
-            call (funcLLvmType f) (nameToSBS fn) largs
+            case workerSignature f of
+                Just sig@(argTypes, retType) | length args == length argTypes -> do
+                    res <- callWorker ctx fn sig args
+                    resolveBoxing retType anyTypeVar res
+                _ -> do
+                    largs <- forM args $ \arg -> cgen ctx arg
+                    call (funcLLvmType f) (nameToSBS fn) largs
         expr -> do
-            -- closures
-            modState <- gets moduleState
+            -- closures, the typer knows the number of arguments, call through the code pointer
             e <- cgen ctx expr
             largs <- mapM (cgen ctx) args
-            let argc = constIntOp (length largs)
-            sargsPtr <- allocaSize ptrType argc
-            let asdf (idx, arg) = do
-                  p <- getelementptr sargsPtr [idx]
-                  store p arg
-            sargs <- bitcast sargsPtr ptrType -- runtimeApply accepts i8*, so need to bitcast. Remove when possible
-            -- cdecl calling convension, arguments passed right to left
-            sequence_ [asdf (constIntOp i, a) | (i, a) <- zip [0..] largs]
-
-            let pos = createPosition $ S.pos meta
-            callBuiltin "runtimeApply" [e, argc, sargs, constOp pos]
-
-cgenArrayApply array idx = do
-    arrayStructPtr <- bitcast array (T.ptr $ arrayStructType ptrType) -- &Array(type, len, &data[])
+            cgenCallClosure meta e largs
+
+{-
+    Unboxed worker/wrapper calling convention.
+    A global function with primitive (Int, Float, Bool etc.) parameters or result gets a worker
+    that takes and returns raw values, like extern functions do. Direct calls go to the worker,
+    the function itself becomes a boxed wrapper for closures and the Functions table.
+-}
+workerSignature :: S.Expr -> Maybe ([Type], Type)
+workerSignature (S.Let True meta _ _ lam _) | not (meta ^. S.isExternal) = do
+    let (args, body) = S.uncurryLambda lam
+    case body of
+        S.EmptyExpr -> Nothing -- data constructor, it has no worker
+        _ -> Just ()
+    (argTypes, retType) <- funcArgTypes (length args) (S.typeOf lam)
+    if any isPrimitiveType (retType : argTypes) then Just (argTypes, retType) else Nothing
+  where
+    funcArgTypes 0 t = Just ([], t)
+    funcArgTypes n (TypeFunc a b) = do
+        (as, r) <- funcArgTypes (n - 1) b
+        return (a : as, r)
+    funcArgTypes _ _ = Nothing
+workerSignature _ = Nothing
+
+workerName fn = nameToSBS fn `mappend` "$worker"
+
+workerFuncType (argTypes, retType) = funcType (externalTypeMapping retType) (map externalTypeMapping argTypes)
+
+callWorker ctx fn sig@(argTypes, _) args = do
+    largs <- forM (zip argTypes args) $ \(tpe, arg) -> cgenUnboxed ctx tpe arg
+    call (workerFuncType sig) (workerName fn) largs
+
+{-
+    Array Int and Array Float are created with raw storage (IntArray/FloatArray in lasca.h)
+    when the typer instantiated the element type. Polymorphic code keeps creating boxed Arrays.
+-}
+primArrayConstructor :: Name -> Type -> Maybe Name
+primArrayConstructor fn tpe = case (fn, tpe) of
+    (NS "Array" "makeArray", TypeArray TypeInt) -> Just (NS "Array" "makeIntArray")
+    (NS "Array" "makeArray", TypeArray TypeFloat) -> Just (NS "Array" "makeFloatArray")
+    (NS "Array" "unsafeCreateArray", TypeArray TypeInt) -> Just (NS "Array" "unsafeCreateIntArray")
+    (NS "Array" "unsafeCreateArray", TypeArray TypeFloat) -> Just (NS "Array" "unsafeCreateFloatArray")
+    (NS "Array" "init", TypeArray TypeInt) -> Just (NS "Array" "initInt")
+    (NS "Array" "init", TypeArray TypeFloat) -> Just (NS "Array" "initFloat")
+    _ -> Nothing
+
+-- a type variable when the array type isn't known, e.g. in polymorphic code
+arrayElemType arrayExpr = case S.typeOf arrayExpr of
+    TypeArray t -> t
+    _ -> anyTypeVar
+
+{-
+    Boxed element of an array.
+    An Array Int or Array Float may still be a boxed Array made by polymorphic code, and polymorphic code
+    may get any kind of array, so these check the array type and read the elements inline.
+    Other kinds go through arrayGetIndex.
+-}
+cgenArrayApply elemType array idx = case elemType of
+    _ | isPrimArrayElem elemType ->
+        cgenIf ptrType (checkTypeId array (primArrayTypeId elemType))
+            (loadArrayElem elemType array idx >>= boxPrimitive elemType)
+            (cgenArrayGetIndex array idx)
+    TVar _ ->
+        cgenIf ptrType (checkTypeId array arrayTypeId) (loadArrayElem anyTypeVar array idx) (cgenArrayGetIndex array idx)
+    _ -> loadArrayElem anyTypeVar array idx
+
+-- Raw element of an Array Int or Array Float
+cgenArrayApplyUnboxed elemType array idx =
+    cgenIf (externalTypeMapping elemType) (checkTypeId array (primArrayTypeId elemType))
+        (loadArrayElem elemType array idx)
+        (cgenArrayGetIndex array idx >>= resolveBoxing anyTypeVar elemType)
+
+isPrimArrayElem tpe = tpe == TypeInt || tpe == TypeFloat
+
+primArrayTypeId TypeInt = intArrayTypeId
+primArrayTypeId TypeFloat = floatArrayTypeId
+primArrayTypeId t = error $ printf "primArrayTypeId: no raw array of %s" (show t)
+
+-- elemType is the raw element type of an IntArray/FloatArray, anything else means Box*
+loadArrayElem elemType array idx = do
+    let llvmType = if isPrimArrayElem elemType then externalTypeMapping elemType else ptrType
+    arrayStructPtr <- bitcast array (T.ptr $ arrayStructType llvmType) -- &Array(type, len, &data[])
     -- TODO check idx is in bounds, eliminatable
     ptr <- getelementptr arrayStructPtr [constIntOp 0, constInt32Op 2, idx]
-    load ptr
+    instrTyped llvmType (I.Load False ptr Nothing 0 [])
+
+storeArrayElem elemType array idx value = do
+    arrayStructPtr <- bitcast array (T.ptr $ arrayStructType (externalTypeMapping elemType))
+    ptr <- getelementptr arrayStructPtr [constIntOp 0, constInt32Op 2, idx]
+    store ptr value
+    return $ constOp $ constRef ptrType "UNIT_SINGLETON"
+
+-- arrayGetIndex and arraySetIndex are declared by the Array module externs
+cgenArrayGetIndex array idx = call (funcType ptrType [ptrType, intType]) "arrayGetIndex" [array, idx]
 
 -------------------------------------------------------------------------------
 -- Compilation
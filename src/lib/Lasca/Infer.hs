@@ -5,6 +5,8 @@
 
 module Lasca.Infer (
   generalizeType,
+  Substitutable(..),
+  substituteAll,
   typeCheck,
   inferExpr,
   inferExprDefault,
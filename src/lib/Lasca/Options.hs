@@ -30,6 +30,7 @@ data LascaOpts = LascaOpts
     , printAst     :: Bool
     , printTypes   :: Bool
     , optimization :: Int
+    , specializeBudget :: Int
     } deriving (Show, Eq)
 
 emptyLascaOpts = LascaOpts {
@@ -41,7 +42,8 @@ emptyLascaOpts = LascaOpts {
     printLLVMAsm = False,
     printAst = False,
     printTypes = False,
-    optimization = 1 -- default to O1 to enable tail call optimization
+    optimization = 1, -- the command line defaults to -O0, tail calls work at any level: see retTail and tailLoopsPhase
+    specializeBudget = 0
 }
 
 optimizeOpt :: Parser Int
@@ -51,6 +53,13 @@ optimizeOpt = option auto
            <> value 0
            <> help "Optimization level for LLVM" )
 
+specializeOpt :: Parser Int
+specializeOpt = option auto
+            ( long "specialize"
+           <> metavar "BUDGET"
+           <> value 0
+           <> help "Clone polymorphic functions for their primitive type instantiations, up to BUDGET expression nodes in total. Static mode only, disabled by default" )
+
 lascaOptsParser :: Parser LascaOpts
 lascaOptsParser = LascaOpts
   <$> some (argument str (metavar "FILES..."))
@@ -82,6 +91,7 @@ lascaOptsParser = LascaOpts
         ( long "print-types"
         <> help "Print inferred types" )
   <*> optimizeOpt
+  <*> specializeOpt
 
 
 parseOptions = execParser opts
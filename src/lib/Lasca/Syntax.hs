@@ -52,6 +52,12 @@ setType expr t = Lens.set (metaLens . exprType) t expr
 
 metaType t = withType emptyMeta t
 
+-- Annotation of constructor applications and closures that don't escape their function, see stackAllocPhase
+stackAllocated :: Text
+stackAllocated = "$stack"
+
+isStackAllocated meta = stackAllocated `elem` _annots meta
+
 data Expr
     = EmptyExpr
     | Literal Meta Lit
@@ -62,6 +68,7 @@ data Expr
     | Match Meta Expr [Case]
     | Closure Meta Name [Arg]   -- LLVM codegen only
     | If Meta Expr Expr Expr
+    | Switch Meta Expr [(Int, Expr)] Expr -- LLVM codegen only: Int scrutinee, cases, default
     | Let Bool Meta Name Type Expr Expr -- True for recursive
     | Array Meta [Expr]
     | Data Meta Name [TVar] [DataConst]
@@ -79,6 +86,7 @@ metaLens = Lens.lens (fst . getset) (snd . getset)
               Select meta tree expr -> (meta, \ m -> Select m tree expr)
               Match meta expr cases -> (meta, \ m -> Match m expr cases)
               If meta cond tr fl -> (meta, \ m -> If m cond tr fl)
+              Switch meta e cases dflt -> (meta, \ m -> Switch m e cases dflt)
               Let r meta name t expr body -> (meta, \ m -> Let r m name t expr body)
               Array meta exprs -> (meta, \ m -> Array m exprs)
               Data meta name tvars constrs -> (meta, \ m -> Data m name tvars constrs)
@@ -109,6 +117,7 @@ instance Eq Expr where
     (Closure _ nl l) == (Closure _ nr r) = nl == nr && l == r
     (Let rl metal nl _ al l) == (Let rr metar nr _ ar r) = rl == rr && nl == nr && al == ar && l == r && (metal^.isExternal) == (metar^.isExternal)
     (If _ nl al l) == (If _ nr ar r) = nl == nr && al == ar && l == r
+    (Switch _ nl al l) == (Switch _ nr ar r) = nl == nr && al == ar && l == r
     (Array _ l) == (Array _ r) = l == r
     (Data _ nl ltvars l) == (Data _ nr rtvars r) = nl == nr && ltvars == rtvars && l == r
     Module _ ln == Module _ rn = ln == rn
@@ -170,6 +179,8 @@ instance DebugPrint Expr where
             let (args, b) = uncurryLambda lam
             printf "def %s(%s): %s = %s;\n%s" (show f) (intercalate "," $ map printExprWithType args) (show t) (printExprWithType b) (printExprWithType next)
         If meta c t f -> printf "if %s then {\n%s \n} else {\n%s\n}" (printExprWithType c) (printExprWithType t) (printExprWithType f)
+        Switch meta e cs d -> printf "switch %s {\n%s\n_ -> %s\n}" (printExprWithType e)
+            (intercalate "\n" $ map (\(tag, b) -> printf "%d -> %s" tag (printExprWithType b)) cs) (printExprWithType d)
         Array _ es -> printf "[%s]" (intercalate "," $ map printExprWithType es)
         Data _ n tvars cs -> printf "data %s %s = %s\n" (show n) (show tvars) (intercalate "\n| " $ map show cs)
         Module meta name -> printf "module %s" (show name)
@@ -196,7 +207,8 @@ emptyCtx opts = Context {
     _constructorArgs = Map.empty,
     _constructorTags = Map.empty,
     _dataDefsNames = Set.empty,
-    _dataDefsFields = Map.empty
+    _dataDefsFields = Map.empty,
+    _fieldSymbolIds = Map.empty
 }
 
 data Lit = IntLit Int
@@ -225,7 +237,8 @@ data Ctx = Context {
     _constructorArgs :: Map Name [Arg], -- data -> constructor -> fields
     _constructorTags :: Map Name (Map Name Int), -- data -> constructor -> tag
     _dataDefsNames :: Set Name,
-    _dataDefsFields :: Map Name (Map Name (Arg, Int))
+    _dataDefsFields :: Map Name (Map Name (Arg, Int)),
+    _fieldSymbolIds :: Map Name Int -- field name -> symbol id, set by collectGlobals
 } deriving (Show, Eq)
 makeLenses ''Ctx
 
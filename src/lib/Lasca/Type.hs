@@ -99,6 +99,7 @@ pattern TypeBool     = TypeIdent "Bool"
 pattern TypeAny      = TypeIdent "Any"
 pattern TypeString   = TypeIdent "String"
 pattern TypeUnit     = TypeIdent "Unit"
+pattern TypeSymbol   = TypeIdent "Symbol"
 pattern TypeArray t  = TypeApply (TypeIdent "Array") [t]
 pattern TypeByteArray t  = TypeApply (TypeIdent "ByteArray") [t]
 pattern TypeArrayInt = TypeArray TypeInt
@@ -13,7 +13,7 @@ import System.FilePath.Glob
 import System.Directory
 import Control.Exception as X
 import qualified Text.Megaparsec as Megaparsec
-import Shelly (shelly, run)
+import Shelly (shelly, run, errExit, lastExitCode)
 
 import Data.Text (Text)
 import qualified Data.Text as T
@@ -131,36 +131,48 @@ typerTests = testGroup "Typer tests"
   ]
 
 data Mode = Dyn | Stat | Both
-data Config = Script { name :: String, compMode :: Mode, arguments :: [T.Text] }
+-- flags are extra compiler flags, -O2 unless they set an optimization level
+data Config = Script { name :: String, compMode :: Mode, arguments :: [T.Text], flags :: [T.Text] }
 
 examples = [
-    Script "builtin.lasca" Both [],
-    Script "Array.lasca" Both [],
-    Script "ArrayBuffer.lasca" Both [],
-    Script "String.lasca" Both [],
-    Script "List.lasca" Both [],
-    Script "binarytrees.lasca" Both ["10"],
-    Script "Data.lasca" Both [],
-    Script "dynamic.lasca" Dyn [],
-    Script "Either.lasca" Both [],
-    Script "factorial.lasca" Both ["15"],
-    Script "hello.lasca" Both [],
-    Script "lambda.lasca" Both [],
-    Script "Map.lasca" Both [],
-    Script "Option.lasca" Both [],
-    Script "regex.lasca" Both [],
-    Script "queen.lasca" Both [],
-    Script "ski.lasca" Both [],
-    Script "nbody.lasca" Both ["50000"],
-    Script "nbody2.lasca" Both ["50000"],
-    Script "nbody3.lasca" Both ["50000"]
+    Script "builtin.lasca" Both [] [],
+    Script "Array.lasca" Both [] [],
+    Script "ArrayBuffer.lasca" Both [] [],
+    Script "String.lasca" Both [] [],
+    Script "List.lasca" Both [] [],
+    Script "binarytrees.lasca" Both ["10"] [],
+    Script "Data.lasca" Both [] [],
+    Script "dynamic.lasca" Dyn [] [],
+    Script "Either.lasca" Both [] [],
+    Script "factorial.lasca" Both ["15"] [],
+    Script "hello.lasca" Both [] [],
+    Script "lambda.lasca" Both [] [],
+    Script "Map.lasca" Both [] [],
+    Script "Option.lasca" Both [] [],
+    Script "regex.lasca" Both [] [],
+    Script "queen.lasca" Both [] [],
+    Script "ski.lasca" Both [] [],
+    Script "nbody.lasca" Both ["50000"] [],
+    Script "nbody2.lasca" Both ["50000"] [],
+    Script "nbody3.lasca" Both ["50000"] [],
+    Script "specialize.lasca" Stat [] ["--specialize", "1000"],
+    Script "vars.lasca" Both [] [],
+    Script "loops.lasca" Both [] [],
+    -- musttail and tail loops don't depend on the optimization level, check both ends
+    Script "tailcalls.lasca" Both [] [],
+    Script "tailcalls.lasca" Both [] ["-O0"],
+    Script "allocation.lasca" Both [] [],
+    Script "arena.lasca" Both [] [],
+    Script "arenaEscape.lasca" Both [] [],
+    Script "symbols.lasca" Both [] [],
+    Script "codepoints.lasca" Both [] []
   ]
 
 prependPath path script = script { name = path </> (name script) }
 withMode s m = s { compMode = m }
 
-mkGoldenTests s@(Script path mode args) = do
-    let testName = takeBaseName path
+mkGoldenTests s@(Script path mode args flags) = do
+    let testName = unwords (takeBaseName path : map T.unpack flags)
     let goldenPath = "src" </> "test" </> "golden" </> replaceExtension path ".golden"
     let example = prependPath "examples" s
     let base = prependPath "libs/base" s
@@ -172,22 +184,31 @@ mkGoldenTests s@(Script path mode args) = do
           _ -> [goldenVsString testName goldenPath (action script)]
     return tests
   where
-      action (Script path mode args) = do
+      action (Script path mode args flags) = do
           let txtPath = T.pack path
-          actual <- runLasca txtPath mode args
+          actual <- runLasca txtPath mode args flags
           let bs = E.encodeUtf8 actual
           return (LBS.fromStrict bs)
 
-runLasca path mode args = shelly $ do
+-- A failing run keeps its output, followed by the exit code, so goldens can cover runtime errors.
+-- Both runs the two modes and gives their output only when they agree, so a golden catches a failure of either
+runLasca path mode args flags = shelly $ errExit False $ do
     let extraArgs = case args of
             [] -> []
             ars -> "--" : args
+    let optFlags = if any ("-O" `T.isPrefixOf`) flags then flags else "-O2" : flags
+    let runMode m = do
+            out <- run "lasca" (["-e"] ++ optFlags ++ ["--mode", m, path] ++ extraArgs)
+            code <- lastExitCode
+            return $ if code == 0 then out else T.concat [out, "exit code ", T.pack (show code), "\n"]
     case mode of
-        Stat -> run "lasca" (["-e", "-O2", "--mode", "static", path] ++ extraArgs)
-        Dyn -> run "lasca" (["-e", "-O2", "--mode", "dynamic", path] ++ extraArgs)
+        Stat -> runMode "static"
+        Dyn -> runMode "dynamic"
         Both -> do
-            run "lasca" (["-e", "-O2", "--mode", "static", "--verbose", path] ++ extraArgs)
-            run "lasca" (["-e", "-O2", "--mode", "dynamic", path] ++ extraArgs)
+            static <- runMode "static"
+            dynamic <- runMode "dynamic"
+            return $ if static == dynamic then static
+                     else T.concat ["static and dynamic modes differ\nstatic:\n", static, "dynamic:\n", dynamic]
 
 compileTests = [
         testProgram "Compile hello.lasca" "lasca" ["-O2", "-o", "hello", "examples/hello.lasca"] Nothing